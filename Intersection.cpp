@@ -9,53 +9,550 @@ class Intersection
 {
 public:
 	bool isIntersected;
-	Object *object;
+	Object::Type type; //which primitive array index refers to
+	int index;
+	int instance; //-1 for world space primitives, else the instance whose shape holds them
+	int material; //material table index of the primitive hit
 	glm::vec3 coord;
+	glm::vec2 bary; //barycentric coordinates on triangles
 
 	Intersection() : isIntersected(false), coord(glm::vec3(0, 0, 0)) {}
 
 	void intersect(const Ray &ray, const Scene &scene);
+
+	// fill in the hit from the closest primitive number found for ray,
+	// -1 for none. closest_inner is its number within an instance's shape
+	void setHit(const Ray &ray, const Scene &scene, float closest_dist, int closest_index, int closest_inner);
+
+	// surface normal at the hit
+	glm::vec3 normal(const Scene &scene) const {
+		if (instance < 0) {
+			if (type == Object::triangle)
+				return scene.mesh.normal(index, bary);
+			return scene.spheres[index].interpolate(coord);
+		}
+
+		// the normal in the shape's space, taken to the world
+		const Instance &inst = scene.instances[instance];
+		const Shape &shape = scene.shapes[inst.shape];
+		if (type == Object::triangle)
+			return inst.normal(shape.mesh.normal(index, bary));
+		glm::vec4 P4 = inst.inv_trans * glm::vec4(coord, 1.0f);
+		return inst.normal(glm::vec3(P4) / P4.w - shape.spheres[index].center);
+	}
 };
 
-Ray transform(const Ray& ray, const Object* obj); //helper to transform ray
+// any hit query: true if some primitive blocks origin + dir * t for epsilon < t < tmax
+bool occluded(const glm::vec3 &origin, const glm::vec3 &dir, float tmax, const Scene &scene);
+
+// rays traced together by the packet traversals, at most
+const int max_packet_size = 16;
+
+// the closest hits of count rays, traced as one packet. the same hits as
+// intersecting the rays one at a time
+void intersectPacket(const Ray *rays, int count, Intersection *hits, const Scene &scene);
+
+// which of count rays are blocked before their tmax, bit r for rays[r],
+// traced as one packet
+int occludedPacket(const Ray *rays, const float *tmax, int count, const Scene &scene);
+
+// direction and distance from P to the light, for the shadow ray. the
+// distance is infinite for directional lights
+void lightDirection(const Light &light, const glm::vec3 &P, glm::vec3 &dir, float &dist);
+
+#ifdef BVH_STATS
+#include <atomic>
+
+// wide nodes tested by all traversals, counted for the benchmarks. a
+// packet tests a node once per ray but fetches it once for all of them
+std::atomic<long> bvh_node_tests(0);
+std::atomic<long> bvh_node_fetches(0);
+#define COUNT_NODE_TEST() bvh_node_tests.fetch_add(1, std::memory_order_relaxed)
+#define COUNT_NODE_FETCH() bvh_node_fetches.fetch_add(1, std::memory_order_relaxed)
+#else
+#define COUNT_NODE_TEST()
+#define COUNT_NODE_FETCH()
+#endif
+
+// a node pushes at most 7 entries more than it pops, and wide trees are
+// no deeper than the binary ones (max_depth 60)
+const int traversal_stack_size = 7 * 61 + 1;
+
+// closest hit traversal of one BVH, nearer children first, from the node
+// root. test(leaf) tests the primitives of a leaf and lowers closest_dist
+// when it finds a hit
+template <class Node, class LeafTest>
+static void closestHit(const std::vector<Node> &nodes, const std::vector<BVHLeaf> &leaves, const Ray &ray,
+					   const float &closest_dist, const LeafTest &test, int root = 0)
+{
+	// distances are ray parameters t. only hits in front of the origin
+	// count, so a box is as close as the start of its interval
+	NodeRay node_ray(ray);
+
+	std::pair<int, float> stack[traversal_stack_size]; // child index and its distance
+	int top = 0;
+	stack[top++] = std::make_pair(root, 0.0f);
+
+	while (top > 0) {
+		const std::pair<int, float> entry = stack[--top];
+		if (entry.second > closest_dist)
+			continue;
+
+		if (entry.first < 0) {
+			test(leaves[~entry.first]);
+			continue;
+		}
+
+		// test all children at once and push the ones hit, farthest first
+		const Node &node = nodes[entry.first];
+		float dist[Node::width];
+		COUNT_NODE_TEST();
+		COUNT_NODE_FETCH();
+		int mask = node.hit(node_ray, epsilon, closest_dist, dist);
+
+		std::pair<int, float> hits[Node::width];
+		int num_hits = 0;
+		for (; mask; mask &= mask - 1) {
+			int lane = __builtin_ctz(mask);
+			std::pair<int, float> hit = std::make_pair(node.child[lane], dist[lane]);
+			int i = num_hits++;
+			for (; i > 0 && hits[i - 1].second < hit.second; i--)
+				hits[i] = hits[i - 1];
+			hits[i] = hit;
+		}
+		for (int i = 0; i < num_hits; i++)
+			stack[top++] = hits[i];
+	}
+}
+
+template <class LeafTest>
+static void closestHit(const BVH &bvh, const Ray &ray, const float &closest_dist, const LeafTest &test)
+{
+	if (!bvh.quantized_nodes.empty())
+		closestHit(bvh.quantized_nodes, bvh.leaves, ray, closest_dist, test);
+	else if (!bvh.nodes.empty())
+		closestHit(bvh.nodes, bvh.leaves, ray, closest_dist, test);
+}
+
+// any hit traversal of one BVH from the node root. test(leaf) returns
+// true if a primitive of the leaf blocks the ray before tmax
+template <class Node, class LeafTest>
+static bool anyHit(const std::vector<Node> &nodes, const std::vector<BVHLeaf> &leaves, const Ray &ray,
+				   float tmax, const LeafTest &test, int root = 0)
+{
+	NodeRay node_ray(ray);
+
+	int stack[traversal_stack_size];
+	int top = 0;
+	stack[top++] = root;
+
+	while (top > 0) {
+		int index = stack[--top];
+		if (index < 0) {
+			if (test(leaves[~index]))
+				return true; // stop at the first blocker
+			continue;
+		}
+
+		const Node &node = nodes[index];
+		float dist[Node::width];
+		COUNT_NODE_TEST();
+		COUNT_NODE_FETCH();
+		for (int mask = node.hit(node_ray, epsilon, tmax, dist); mask; mask &= mask - 1)
+			stack[top++] = node.child[__builtin_ctz(mask)];
+	}
+	return false;
+}
+
+template <class LeafTest>
+static bool anyHit(const BVH &bvh, const Ray &ray, float tmax, const LeafTest &test)
+{
+	if (!bvh.quantized_nodes.empty())
+		return anyHit(bvh.quantized_nodes, bvh.leaves, ray, tmax, test);
+	if (!bvh.nodes.empty())
+		return anyHit(bvh.nodes, bvh.leaves, ray, tmax, test);
+	return false;
+}
+
+// a node (or leaf ~node) of a packet traversal, with the rays of the
+// packet that enter it (bit r for ray r) and where each of them does
+class PacketEntry
+{
+public:
+	int node;
+	int mask;
+	float dist[max_packet_size];
+};
+
+// which children of node each ray of mask enters: bit r of child_mask[i]
+// for ray r entering child i, at child_dist[i][r]
+template <class Node>
+static void packetChildren(const Node &node, const NodeRay *node_rays, int mask, const float *t_max,
+						   int *child_mask, float (*child_dist)[max_packet_size])
+{
+	for (int i = 0; i < Node::width; i++)
+		child_mask[i] = 0;
+	COUNT_NODE_FETCH();
+	for (; mask; mask &= mask - 1) {
+		int r = __builtin_ctz(mask);
+		float dist[Node::width];
+		COUNT_NODE_TEST();
+		for (int hit = node.hit(node_rays[r], epsilon, t_max[r], dist); hit; hit &= hit - 1) {
+			int lane = __builtin_ctz(hit);
+			child_mask[lane] |= 1 << r;
+			child_dist[lane][r] = dist[lane];
+		}
+	}
+}
+
+// closest hit traversal of one BVH for a packet of up to max_packet_size
+// rays. a node is visited once for all the rays that enter it, which share
+// its fetch and are tested against its children by the 8-wide kernel one
+// after the other. each ray is culled by its own closest hit as in
+// closestHit, so the hits are the same. once a subtree is entered by a
+// single ray, it goes on alone with closestHit. test(leaf, r) tests ray r
+template <class Node, class LeafTest>
+static void closestHitPacket(const std::vector<Node> &nodes, const std::vector<BVHLeaf> &leaves, const Ray *rays,
+							 int count, const float *closest_dist, const LeafTest &test)
+{
+	NodeRay node_rays[max_packet_size];
+	for (int r = 0; r < count; r++)
+		node_rays[r] = NodeRay(rays[r]);
+
+	PacketEntry stack[traversal_stack_size];
+	int top = 0;
+	stack[top].node = 0;
+	stack[top].mask = (1 << count) - 1;
+	for (int r = 0; r < count; r++)
+		stack[top].dist[r] = 0.0f;
+	top++;
+
+	while (top > 0) {
+		const PacketEntry &entry = stack[--top];
+		int index = entry.node;
+		int mask = 0;
+		for (int m = entry.mask; m; m &= m - 1) {
+			int r = __builtin_ctz(m);
+			if (entry.dist[r] <= closest_dist[r])
+				mask |= 1 << r;
+		}
+		if (!mask)
+			continue;
+
+		if (index < 0) {
+			for (; mask; mask &= mask - 1)
+				test(leaves[~index], __builtin_ctz(mask));
+			continue;
+		}
+
+		// the packet has diverged here
+		if (!(mask & (mask - 1))) {
+			int r = __builtin_ctz(mask);
+			closestHit(nodes, leaves, rays[r], closest_dist[r], [&](const BVHLeaf &leaf) { test(leaf, r); }, index);
+			continue;
+		}
+
+		const Node &node = nodes[index];
+		int child_mask[Node::width];
+		float child_dist[Node::width][max_packet_size];
+		packetChildren(node, node_rays, mask, closest_dist, child_mask, child_dist);
+
+		// push the children entered, farthest first for the first ray
+		// entering each
+		int order[Node::width];
+		int num_hits = 0;
+		for (int lane = 0; lane < Node::width; lane++) {
+			if (!child_mask[lane])
+				continue;
+			float key = child_dist[lane][__builtin_ctz(child_mask[lane])];
+			int i = num_hits++;
+			for (; i > 0 && child_dist[order[i - 1]][__builtin_ctz(child_mask[order[i - 1]])] < key; i--)
+				order[i] = order[i - 1];
+			order[i] = lane;
+		}
+		for (int i = 0; i < num_hits; i++) {
+			PacketEntry &pushed = stack[top++];
+			pushed.node = node.child[order[i]];
+			pushed.mask = child_mask[order[i]];
+			for (int m = pushed.mask; m; m &= m - 1) {
+				int r = __builtin_ctz(m);
+				pushed.dist[r] = child_dist[order[i]][r];
+			}
+		}
+	}
+}
+
+template <class LeafTest>
+static void closestHitPacket(const BVH &bvh, const Ray *rays, int count, const float *closest_dist, const LeafTest &test)
+{
+	if (!bvh.quantized_nodes.empty())
+		closestHitPacket(bvh.quantized_nodes, bvh.leaves, rays, count, closest_dist, test);
+	else if (!bvh.nodes.empty())
+		closestHitPacket(bvh.nodes, bvh.leaves, rays, count, closest_dist, test);
+}
+
+// any hit traversal of one BVH for a packet of up to max_packet_size rays,
+// returning the mask of the rays blocked before their tmax. test(leaf, r)
+// returns true if a primitive of the leaf blocks ray r. like
+// closestHitPacket, rays left alone in a subtree go on with anyHit
+template <class Node, class LeafTest>
+static int anyHitPacket(const std::vector<Node> &nodes, const std::vector<BVHLeaf> &leaves, const Ray *rays,
+						const float *tmax, int count, const LeafTest &test)
+{
+	NodeRay node_rays[max_packet_size];
+	for (int r = 0; r < count; r++)
+		node_rays[r] = NodeRay(rays[r]);
+
+	const int all = (1 << count) - 1;
+	int blocked = 0;
+
+	std::pair<int, int> stack[traversal_stack_size]; // node and the rays entering it
+	int top = 0;
+	stack[top++] = std::make_pair(0, all);
+
+	while (top > 0) {
+		const std::pair<int, int> entry = stack[--top];
+		int index = entry.first;
+		int mask = entry.second & ~blocked;
+		if (!mask)
+			continue;
+
+		if (index < 0) {
+			for (; mask; mask &= mask - 1) {
+				int r = __builtin_ctz(mask);
+				if (test(leaves[~index], r))
+					blocked |= 1 << r;
+			}
+			if (blocked == all)
+				break; // stop once every ray is blocked
+			continue;
+		}
+
+		if (!(mask & (mask - 1))) {
+			int r = __builtin_ctz(mask);
+			if (anyHit(nodes, leaves, rays[r], tmax[r], [&](const BVHLeaf &leaf) { return test(leaf, r); }, index))
+				blocked |= 1 << r;
+			continue;
+		}
+
+		const Node &node = nodes[index];
+		int child_mask[Node::width];
+		float child_dist[Node::width][max_packet_size];
+		packetChildren(node, node_rays, mask, tmax, child_mask, child_dist);
+		for (int lane = 0; lane < Node::width; lane++)
+			if (child_mask[lane])
+				stack[top++] = std::make_pair(node.child[lane], child_mask[lane]);
+	}
+	return blocked;
+}
+
+template <class LeafTest>
+static int anyHitPacket(const BVH &bvh, const Ray *rays, const float *tmax, int count, const LeafTest &test)
+{
+	if (!bvh.quantized_nodes.empty())
+		return anyHitPacket(bvh.quantized_nodes, bvh.leaves, rays, tmax, count, test);
+	if (!bvh.nodes.empty())
+		return anyHitPacket(bvh.nodes, bvh.leaves, rays, tmax, count, test);
+	return 0;
+}
+
+// closest hit on the primitives of a shape, with the ray in its space.
+// closest_index is a primitive number of the shape's BVH; a hit at
+// closest_dist only wins over it with a lower number
+static bool intersectShape(const Shape &shape, const Ray &ray, float &closest_dist, int &closest_index, glm::vec2 &bary)
+{
+	const BVH &bvh = shape.bvh;
+	bool found = false;
+	closestHit(bvh, ray, closest_dist, [&](const BVHLeaf &leaf) {
+		for (int b = leaf.block; b < leaf.block + leaf.blocks; b++)
+			found |= bvh.blocks[b].hit(ray, epsilon, closest_dist, closest_index, bary);
+
+		for (int i = leaf.first; i < leaf.first + leaf.count; i++) {
+			int primitive = bvh.indices[i];
+			float t_val = 0;
+			if (shape.spheres[primitive - bvh.num_triangles].hit(ray, epsilon, t_val) &&
+				(t_val < closest_dist || (t_val == closest_dist && primitive < closest_index))) {
+				closest_dist = t_val;
+				closest_index = primitive;
+				found = true;
+			}
+		}
+	});
+	return found;
+}
+
+// test the primitives of a leaf of the scene's BVH for a hit closer than
+// closest_dist, and make it the closest if there is one. closest_inner
+// and bary are those of the closest hit
+static void closestInLeaf(const BVHLeaf &leaf, const Ray &ray, const Scene &scene, float &closest_dist,
+						  int &closest_index, int &closest_inner, glm::vec2 &bary)
+{
+	const BVH &bvh = scene.bvh;
+
+	// one kernel per primitive type in the leaf
+	for (int b = leaf.block; b < leaf.block + leaf.blocks; b++)
+		bvh.blocks[b].hit(ray, epsilon, closest_dist, closest_index, bary);
+
+	for (int i = leaf.first; i < leaf.first + leaf.count; i++) {
+		int primitive = bvh.indices[i];
+		float t_val = 0;
+
+		// on a tie the lower primitive number wins
+		if (bvh.isSphere(primitive)) {
+			if (scene.spheres[primitive - bvh.num_triangles].hit(ray, epsilon, t_val) &&
+				(t_val < closest_dist || (t_val == closest_dist && primitive < closest_index))) {
+				closest_dist = t_val; // update closest distance to a primitive
+				closest_index = primitive;
+			}
+			continue;
+		}
+
+		// the shape of an instance is tested in its space. a tie goes to
+		// the instance if it has the lower number, so its hits start out
+		// beating every inner number or none
+		const Instance &inst = scene.instances[primitive - bvh.num_triangles - bvh.num_spheres];
+		int inner = closest_index < primitive ? -1 : std::numeric_limits<int>::max();
+		glm::vec2 inner_bary;
+		if (intersectShape(scene.shapes[inst.shape], transform(ray, inst.inv_trans), closest_dist, inner, inner_bary)) {
+			closest_index = primitive;
+			closest_inner = inner;
+			bary = inner_bary;
+		}
+	}
+}
 
 void Intersection::intersect(const Ray &ray, const Scene &scene)
 {
 	float closest_dist = std::numeric_limits<float>::max();
-	object = nullptr;
+	int closest_index = -1;
+	int closest_inner = -1; // primitive number within the shape of an instance
+
+	closestHit(scene.bvh, ray, closest_dist, [&](const BVHLeaf &leaf) {
+		closestInLeaf(leaf, ray, scene, closest_dist, closest_index, closest_inner, bary);
+	});
+	setHit(ray, scene, closest_dist, closest_index, closest_inner);
+}
+
+void Intersection::setHit(const Ray &ray, const Scene &scene, float closest_dist, int closest_index, int closest_inner)
+{
+	const BVH &bvh = scene.bvh;
 	isIntersected = false;
+	if (closest_index < 0)
+		return;
 
-	for (Object *obj : scene.objects) {
-		Ray trans_ray = transform(ray, obj);
-		float t_val = 0;
+	isIntersected = true;
+	coord = ray.origin + ray.direction * closest_dist;
+
+	// primitives of an instance are numbered within its shape
+	const BVH *level = &bvh;
+	const Mesh *mesh = &scene.mesh;
+	const std::vector<Sphere> *spheres = &scene.spheres;
+	instance = -1;
+	if (!bvh.isTriangle(closest_index) && !bvh.isSphere(closest_index)) {
+		instance = closest_index - bvh.num_triangles - bvh.num_spheres;
+		const Shape &shape = scene.shapes[scene.instances[instance].shape];
+		level = &shape.bvh;
+		mesh = &shape.mesh;
+		spheres = &shape.spheres;
+		closest_index = closest_inner;
+	}
 
-		if (obj->hit(trans_ray, t_val)) {
-			glm::vec3 P_prime  = trans_ray.origin + trans_ray.direction * t_val;
-			glm::vec4 P_world4 = obj->trans * glm::vec4(P_prime, 1.0f);
+	if (level->isTriangle(closest_index)) {
+		type = Object::triangle;
+		index = closest_index;
+		material = mesh->materials[index];
+	}
+	else {
+		type = Object::sphere;
+		index = closest_index - level->num_triangles;
+		material = (*spheres)[index].material;
+	}
+}
 
-			glm::vec3 P_world = glm::vec3(P_world4) / P_world4.w;
+// any primitive of a shape blocking the ray, in its space
+static bool occludedShape(const Shape &shape, const Ray &ray, float tmax)
+{
+	const BVH &bvh = shape.bvh;
+	return anyHit(bvh, ray, tmax, [&](const BVHLeaf &leaf) {
+		for (int b = leaf.block; b < leaf.block + leaf.blocks; b++)
+			if (bvh.blocks[b].occludes(ray, epsilon, tmax))
+				return true;
 
-			t_val = glm::length(P_world - ray.origin);
+		for (int i = leaf.first; i < leaf.first + leaf.count; i++) {
+			float t_val;
+			if (shape.spheres[bvh.indices[i] - bvh.num_triangles].hit(ray, epsilon, t_val) && t_val < tmax)
+				return true;
+		}
+		return false;
+	});
+}
 
-			if (t_val < closest_dist) {
-				closest_dist = t_val; // update closest distance to an object
-				coord = P_world;
-				object = obj;
-				isIntersected = true;
-			}
+// any primitive of a leaf of the scene's BVH blocking the ray before tmax
+static bool occludedInLeaf(const BVHLeaf &leaf, const Ray &ray, float tmax, const Scene &scene)
+{
+	const BVH &bvh = scene.bvh;
+	for (int b = leaf.block; b < leaf.block + leaf.blocks; b++)
+		if (bvh.blocks[b].occludes(ray, epsilon, tmax))
+			return true;
+
+	for (int i = leaf.first; i < leaf.first + leaf.count; i++) {
+		int primitive = bvh.indices[i];
+		if (bvh.isSphere(primitive)) {
+			float t_val;
+			if (scene.spheres[primitive - bvh.num_triangles].hit(ray, epsilon, t_val) && t_val < tmax)
+				return true;
+			continue;
 		}
+
+		const Instance &inst = scene.instances[primitive - bvh.num_triangles - bvh.num_spheres];
+		if (occludedShape(scene.shapes[inst.shape], transform(ray, inst.inv_trans), tmax))
+			return true;
 	}
+	return false;
+}
+
+bool occluded(const glm::vec3 &origin, const glm::vec3 &dir, float tmax, const Scene &scene)
+{
+	Ray ray(origin, dir);
+	return anyHit(scene.bvh, ray, tmax, [&](const BVHLeaf &leaf) {
+		return occludedInLeaf(leaf, ray, tmax, scene);
+	});
 }
 
-Ray transform(const Ray& ray, const Object* obj) {
-    glm::vec4 trans_origin(ray.origin, 1.0f);
-    glm::vec4 trans_direction(ray.direction, 0.0f);
+void intersectPacket(const Ray *rays, int count, Intersection *hits, const Scene &scene)
+{
+	float closest_dist[max_packet_size];
+	int closest_index[max_packet_size];
+	int closest_inner[max_packet_size];
+	for (int r = 0; r < count; r++) {
+		closest_dist[r] = std::numeric_limits<float>::max();
+		closest_index[r] = -1;
+		closest_inner[r] = -1;
+	}
+
+	closestHitPacket(scene.bvh, rays, count, closest_dist, [&](const BVHLeaf &leaf, int r) {
+		closestInLeaf(leaf, rays[r], scene, closest_dist[r], closest_index[r], closest_inner[r], hits[r].bary);
+	});
+	for (int r = 0; r < count; r++)
+		hits[r].setHit(rays[r], scene, closest_dist[r], closest_index[r], closest_inner[r]);
+}
 
-    trans_origin = obj->inv_trans * trans_origin;
-    trans_direction = obj->inv_trans * trans_direction;
+int occludedPacket(const Ray *rays, const float *tmax, int count, const Scene &scene)
+{
+	return anyHitPacket(scene.bvh, rays, tmax, count, [&](const BVHLeaf &leaf, int r) {
+		return occludedInLeaf(leaf, rays[r], tmax[r], scene);
+	});
+}
 
-	glm::vec3 ret_origin = glm::vec3(trans_origin) / trans_origin.w;
-	glm::vec3 ret_direction = glm::vec3(trans_direction);
-	
-    return Ray(ret_origin, ret_direction);
-}
\ No newline at end of file
+void lightDirection(const Light &light, const glm::vec3 &P, glm::vec3 &dir, float &dist)
+{
+	if (light.type == Light::point) {
+		dir = light.coord - P;
+		dist = glm::length(dir);
+		dir /= dist;
+	}
+	else {
+		dir = glm::normalize(light.coord);
+		dist = std::numeric_limits<float>::infinity();
+	}
+}
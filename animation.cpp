@@ -0,0 +1,84 @@
+#include <algorithm>
+#include <limits>
+
+#include "scene.h"
+#include "transform.h"
+
+glm::mat4 TransformKey::matrix() const
+{
+	return Transform::translate(translation.x, translation.y, translation.z) * glm::mat4_cast(rotation) *
+		   Transform::scale(scale.x, scale.y, scale.z);
+}
+
+bool Scene::frameRange(int &first, int &last) const
+{
+	// the camera keys do not move the views, so they have no frames then
+	bool camera_frames = views.empty() && !camera_keys.empty();
+	if (!camera_frames && transform_keys.empty())
+		return false;
+
+	first = std::numeric_limits<int>::max();
+	last = std::numeric_limits<int>::min();
+	if (camera_frames)
+		for (const CameraKey &key : camera_keys)
+		{
+			first = std::min(first, key.frame);
+			last = std::max(last, key.frame);
+		}
+	for (const TransformKey &key : transform_keys)
+	{
+		first = std::min(first, key.frame);
+		last = std::max(last, key.frame);
+	}
+	return true;
+}
+
+void Scene::setFrame(int frame, std::vector<int> &moved)
+{
+	int a, b;
+	float t;
+
+	// at a key, or outside of the keys, the key is taken as it is
+	if (!camera_keys.empty())
+	{
+		findKeys(camera_keys.data(), camera_keys.size(), frame, a, b, t);
+		const CameraKey &from = camera_keys[a];
+		const CameraKey &to = camera_keys[b];
+		cam.eye = glm::mix(from.eye, to.eye, t);
+		cam.center = glm::mix(from.center, to.center, t);
+		cam.up = glm::mix(from.up, to.up, t);
+		cam.fovy = glm::mix(from.fovy, to.fovy, t);
+	}
+
+	// every animation once, for all the instances under it
+	std::vector<glm::mat4> matrices(animations.size());
+	for (size_t i = 0; i < animations.size(); i++)
+	{
+		const Animation &animation = animations[i];
+		const TransformKey *keys = transform_keys.data() + animation.first_key;
+		findKeys(keys, animation.keys, frame, a, b, t);
+
+		TransformKey key = keys[a];
+		if (b != a)
+		{
+			key.translation = glm::mix(keys[a].translation, keys[b].translation, t);
+			key.rotation = glm::slerp(keys[a].rotation, keys[b].rotation, t);
+			key.scale = glm::mix(keys[a].scale, keys[b].scale, t);
+		}
+		matrices[i] = animation.parent * key.matrix();
+	}
+
+	// only the instances whose transform changed need their bounds refit
+	int first_instance = mesh.size() + spheres.size();
+	for (const AnimatedInstance &animated : animated_instances)
+	{
+		glm::mat4 M = matrices[animated.animation] * animated.local;
+		Instance &instance = instances[animated.instance];
+		if (M != instance.trans)
+		{
+			instance.trans = M;
+			instance.inv_trans = glm::inverse(M);
+			moved.push_back(first_instance + animated.instance);
+		}
+	}
+}
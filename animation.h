@@ -0,0 +1,63 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "geometry.h"
+
+#include <glm/gtc/quaternion.hpp>
+
+//camera of a frame of the sequence, given by the cameraKey command.
+//between keys the camera moves linearly
+class CameraKey {
+	public:
+		int frame;
+		glm::vec3 eye, center, up;
+		float fovy;
+};
+
+//transform of an animation at a frame, given by the transformKey
+//command. it is the translation of the rotation of the scale, as if they
+//were given in that order. between keys the translation and scale move
+//linearly and the rotation along the shortest arc
+class TransformKey {
+	public:
+		int frame;
+		glm::vec3 translation;
+		glm::quat rotation;
+		glm::vec3 scale;
+
+		glm::mat4 matrix() const;
+};
+
+//an animated transform, from the first transformKey at a level of the
+//transform stack to the popTransform of that level. its keys are
+//Scene::transform_keys[first_key] up to first_key + keys, in frame order.
+//instances placed under it are at parent * matrix(frame) * their local
+//transform, where parent is the transform in effect at the first key
+class Animation {
+	public:
+		glm::mat4 parent;
+		int first_key;
+		int keys;
+};
+
+//an instance placed under an animation
+class AnimatedInstance {
+	public:
+		int instance; //index into the scene's instances
+		int animation;
+		glm::mat4 local; //transforms between the animation and the instance
+};
+
+//the keys to mix at frame: a and b index keys, which are in frame order,
+//and b has weight t. before the first key and after the last both are
+//that key
+template <class Key>
+void findKeys(const Key* keys, int count, int frame, int& a, int& b, float& t) {
+	a = 0;
+	while (a + 1 < count && keys[a + 1].frame <= frame)
+		a++;
+	b = a + 1 < count && keys[a].frame < frame ? a + 1 : a;
+	t = b == a ? 0.0f : (float)(frame - keys[a].frame) / (float)(keys[b].frame - keys[a].frame);
+}
+
+#endif
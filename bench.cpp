@@ -0,0 +1,713 @@
+// microbenchmarks for the raytracer internals
+// usage: bench kernel scene.test
+//        bench parse scene.test
+//        bench build scene.test [max_threads]
+//        bench bvh scene.test
+//        bench refit scene.test [frames]
+//        bench packets scene.test
+//        bench sort scene.test
+
+#include <chrono>
+#include <cstring>
+#include <random>
+
+#define BVH_STATS
+#include "Intersection.cpp"
+#include "mappedfile.h"
+#include "raygen.h"
+#include "scheduler.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// the area based triangle test that Triangle::hit used before the
+// Moller-Trumbore kernel, kept as the reference for the kernel benchmark
+static bool areaHit(const Ray &ray, const glm::vec3 &A, const glm::vec3 &B, const glm::vec3 &C, float t_min, float &t_val)
+{
+	glm::vec3 norm = glm::cross(B - A, C - A);
+	float dir_dot_norm = glm::dot(ray.direction, norm);
+
+	if (glm::abs(dir_dot_norm) < epsilon)
+		return false;
+
+	float tmp_t_val = glm::dot(A, norm) - glm::dot(ray.origin, norm);
+	tmp_t_val /= glm::dot(ray.direction, norm);
+
+	if (tmp_t_val <= t_min)
+		return false;
+
+	glm::vec3 P = ray.origin + ray.direction * tmp_t_val;
+
+	glm::vec3 area(0.0f, 0.0f, 0.0f);
+	float area_val = 0.0f;
+
+	glm::vec3 tmp_cross = glm::cross(P - A, P - B);
+	area_val += glm::length(tmp_cross);
+	area += tmp_cross;
+
+	tmp_cross = glm::cross(P - B, P - C);
+	area_val += glm::length(tmp_cross);
+	area += tmp_cross;
+
+	tmp_cross = glm::cross(P - C, P - A);
+	area_val += glm::length(tmp_cross);
+	area += tmp_cross;
+
+	glm::vec3 cross1 = glm::cross(C - P, A - P);
+	glm::vec3 cross2 = glm::cross(A - P, B - P);
+
+	float norm_dot_norm = glm::dot(norm, norm);
+
+	float beta = glm::dot(cross1, norm) / norm_dot_norm;
+	float gamma = glm::dot(cross2, norm) / norm_dot_norm;
+	float alpha = 1.0 - beta - gamma;
+
+	float one_eps = 1.0f + epsilon;
+	if (beta > -epsilon && beta < one_eps &&
+		gamma > -epsilon && gamma < one_eps &&
+		alpha > -epsilon && alpha < one_eps)
+	{
+		t_val = tmp_t_val;
+		return true;
+	}
+	return false;
+}
+
+// time the old and the new triangle test on every triangle of the scene
+// against rays from the camera aimed at random triangles
+static int benchKernel(const char *scenefile)
+{
+	Scene scene;
+	scene.readfile(scenefile);
+
+	std::vector<Triangle> triangles;
+	for (size_t t = 0; t < scene.mesh.size(); t++)
+		triangles.push_back(scene.mesh.triangle(t));
+	if (triangles.empty())
+	{
+		cerr << "No triangles in " << scenefile << "\n";
+		return 1;
+	}
+
+	const int num_rays = 256;
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	std::vector<Ray> rays;
+	for (int i = 0; i < num_rays; i++)
+	{
+		const Triangle *tri = &triangles[rng() % triangles.size()];
+		float u = unit(rng), v = unit(rng);
+		if (u + v > 1.0f)
+		{
+			u = 1.0f - u;
+			v = 1.0f - v;
+		}
+		glm::vec3 target = tri->vertex + u * tri->edge1 + v * tri->edge2;
+		rays.push_back(Ray(scene.cam.eye, glm::normalize(target - scene.cam.eye)));
+	}
+
+	double tests = (double)num_rays * triangles.size();
+	cout << triangles.size() << " triangles, " << num_rays << " rays\n";
+
+	long hits_old = 0;
+	double t_sum_old = 0;
+	Clock::time_point start = Clock::now();
+	for (const Ray &ray : rays)
+		for (const Triangle &tri : triangles)
+		{
+			float t_val;
+			if (areaHit(ray, tri.vertex, tri.vertex + tri.edge1, tri.vertex + tri.edge2, epsilon, t_val))
+			{
+				hits_old++;
+				t_sum_old += t_val;
+			}
+		}
+	double old_time = secondsSince(start);
+
+	long hits_new = 0;
+	double t_sum_new = 0;
+	start = Clock::now();
+	for (const Ray &ray : rays)
+		for (const Triangle &tri : triangles)
+		{
+			float t_val;
+			glm::vec2 bary;
+			if (tri.hit(ray, epsilon, t_val, bary))
+			{
+				hits_new++;
+				t_sum_new += t_val;
+			}
+		}
+	double new_time = secondsSince(start);
+
+	cout << "area based:      " << old_time * 1e9 / tests << " ns/test, " << hits_old << " hits, t sum " << t_sum_old << "\n";
+	cout << "Moller-Trumbore: " << new_time * 1e9 / tests << " ns/test, " << hits_new << " hits, t sum " << t_sum_new << "\n";
+	cout << "speedup:         " << old_time / new_time << "x\n";
+
+	// the same triangles packed 8 to a block, closest hit per block
+	std::vector<TriBlock> blocks((triangles.size() + TriBlock::width - 1) / TriBlock::width);
+	for (size_t i = 0; i < triangles.size(); i++)
+		blocks[i / TriBlock::width].set(i % TriBlock::width, triangles[i], i);
+
+	for (bool avx2 : {false, true})
+	{
+		if (!TriBlock::useAVX2(avx2))
+			continue;
+
+		long hits_block = 0;
+		double t_sum_block = 0;
+		start = Clock::now();
+		for (const Ray &ray : rays)
+			for (const TriBlock &block : blocks)
+			{
+				float t_val = std::numeric_limits<float>::max();
+				int index = -1;
+				glm::vec2 bary;
+				if (block.hit(ray, epsilon, t_val, index, bary))
+				{
+					hits_block++;
+					t_sum_block += t_val;
+				}
+			}
+		double block_time = secondsSince(start);
+		cout << "8-wide " << TriBlock::kernelName() << ": " << string(8 - strlen(TriBlock::kernelName()), ' ')
+			 << block_time * 1e9 / tests << " ns/test, " << hits_block << " hit blocks, t sum " << t_sum_block
+			 << ", " << old_time / block_time << "x\n";
+	}
+
+	return 0;
+}
+
+// time Scene::readfile, or Scene::load for compiled scenes, best of a few runs
+static int benchParse(const char *scenefile)
+{
+	const int runs = 5;
+	bool compiled = Scene::isCompiled(scenefile);
+	double best = 0;
+	for (int run = 0; run < runs; run++)
+	{
+		Clock::time_point start = Clock::now();
+		Scene scene;
+		if (compiled && !scene.load(scenefile))
+			return 1;
+		if (!compiled)
+			scene.readfile(scenefile);
+		double time = secondsSince(start);
+		if (run == 0 || time < best)
+			best = time;
+
+		if (run == 0)
+			cout << scene.mesh.size() << " triangles, " << scene.mesh.positions.size() << " mesh vertices, "
+				 << scene.spheres.size() << " spheres, " << scene.shapes.size() << " shapes, "
+				 << scene.instances.size() << " instances, " << scene.materials.size() << " materials\n";
+	}
+
+	MappedFile file;
+	double megabytes = file.open(scenefile) ? file.size() / 1e6 : 0;
+	cout << (compiled ? "load: " : "readfile: ") << best * 1e3 << " ms, " << megabytes / best << " MB/s\n";
+	return 0;
+}
+
+// time the BVH builders with 1, 2, 4, ... up to max_threads threads and
+// compare the SAH cost of their trees to the exact sweep
+static int benchBuild(const char *scenefile, int max_threads)
+{
+	Scene scene;
+	scene.readfile(scenefile);
+	cout << scene.mesh.size() << " triangles, " << scene.spheres.size() << " spheres, "
+		 << Scheduler::hardwareThreads() << " hardware threads\n";
+
+	std::vector<int> thread_counts;
+	for (int threads = 1; threads < max_threads; threads *= 2)
+		thread_counts.push_back(threads);
+	thread_counts.push_back(max_threads);
+
+	float sweep_cost = 0;
+	for (BVH::Method method : {BVH::sweep, BVH::binned, BVH::lbvh, BVH::sbvh})
+	{
+		double single_thread = 0;
+		std::vector<WideNode> single_thread_nodes;
+		BVH::Options options;
+		options.method = method;
+		for (int threads : thread_counts)
+		{
+			// best of a few builds
+			double best = 0;
+			for (int run = 0; run < 3; run++)
+			{
+				Clock::time_point start = Clock::now();
+				scene.buildBVH(options, threads);
+				double time = secondsSince(start);
+				if (run == 0 || time < best)
+					best = time;
+			}
+			if (threads == 1)
+			{
+				single_thread = best;
+				single_thread_nodes = scene.bvh.nodes;
+			}
+
+			// the tree must not depend on the number of threads
+			bool same = scene.bvh.nodes.size() == single_thread_nodes.size() &&
+						memcmp(scene.bvh.nodes.data(), single_thread_nodes.data(), scene.bvh.nodes.size() * sizeof(WideNode)) == 0;
+
+			float cost = scene.bvh.cost();
+			if (method == BVH::sweep)
+				sweep_cost = cost;
+			cout << BVH::methodName(method) << string(8 - strlen(BVH::methodName(method)), ' ')
+				 << threads << " threads: " << best * 1e3 << " ms, speedup " << single_thread / best
+				 << "x, " << scene.bvh.nodes.size() << " nodes, " << scene.bvh.indices.size() << " references, "
+				 << scene.bvh.spatial_splits << " spatial splits, SAH cost " << cost
+				 << " (" << (cost / sweep_cost - 1.0f) * 100.0f << "% vs sweep)"
+				 << (same ? "" : ", DIFFERS from 1 thread") << "\n";
+
+			if (method == BVH::sweep || method == BVH::sbvh)
+				break; // single threaded
+		}
+	}
+	return 0;
+}
+
+// trace the primary rays of the image plus a shadow ray to every light
+// from each hit, counting the hits and the shadowed ones. returns the seconds
+static double traceFrame(const Scene &scene, Scheduler &scheduler, long &total_hits, long &total_shadowed)
+{
+	// the camera rays of the renderer
+	RayGenerator camera(scene.cam, scene.width, scene.height);
+
+	std::vector<long> hits(scene.height), shadowed(scene.height);
+	Clock::time_point start = Clock::now();
+	scheduler.run(scene.height, [&](int i, int) {
+		for (int j = 0; j < scene.width; j++)
+		{
+			Ray ray = camera.ray(i, j);
+
+			Intersection hit;
+			hit.intersect(ray, scene);
+			if (!hit.isIntersected)
+				continue;
+			hits[i]++;
+
+			for (const Light &light : scene.lights)
+			{
+				bool point = light.type == Light::point;
+				glm::vec3 dir = point ? light.coord - hit.coord : light.coord;
+				float dist = point ? glm::length(dir) : std::numeric_limits<float>::infinity();
+				shadowed[i] += occluded(hit.coord, glm::normalize(dir), dist, scene);
+			}
+		}
+	});
+	double seconds = secondsSince(start);
+
+	total_hits = total_shadowed = 0;
+	for (int i = 0; i < scene.height; i++)
+	{
+		total_hits += hits[i];
+		total_shadowed += shadowed[i];
+	}
+	return seconds;
+}
+
+// trade-off between building and tracing: for every BVH method and node
+// layout, the build time and the time to trace the primary rays of the
+// image plus a shadow ray to every light from each hit, on all hardware
+// threads, with the node memory and the wide nodes tested per ray
+// traceFrame with the rays in packets of packet_size, one or two rows of
+// 8 pixels, traced as the renderer does. 0 traces single rays
+static double tracePacketFrame(const Scene &scene, Scheduler &scheduler, int packet_size, long &total_hits,
+							   long &total_shadowed)
+{
+	RayGenerator camera(scene.cam, scene.width, scene.height);
+	int rows = std::max(packet_size / RayPacket::width, 1);
+	int bands = (scene.height + rows - 1) / rows;
+
+	std::vector<long> hits(bands), shadowed(bands);
+	Clock::time_point start = Clock::now();
+	scheduler.run(bands, [&](int band, int) {
+		int i = band * rows;
+		int num_rows = std::min(rows, scene.height - i);
+		RayPacket packet;
+		Ray rays[max_packet_size];
+		Intersection results[max_packet_size];
+		for (int j = 0; j < scene.width; j += RayPacket::width)
+		{
+			int count = 0;
+			for (int row = 0; row < num_rows; row++)
+			{
+				camera.packet(i + row, j, packet);
+				for (int lane = 0; lane < packet.count; lane++)
+					rays[count++] = packet.ray(lane);
+			}
+
+			if (packet_size > 0)
+				intersectPacket(rays, count, results, scene);
+			else
+				for (int r = 0; r < count; r++)
+					results[r].intersect(rays[r], scene);
+			for (int r = 0; r < count; r++)
+				hits[band] += results[r].isIntersected;
+
+			for (const Light &light : scene.lights)
+			{
+				Ray shadow_rays[max_packet_size];
+				float dist[max_packet_size];
+				int num_shadow = 0;
+				for (int r = 0; r < count; r++)
+				{
+					if (!results[r].isIntersected)
+						continue;
+					glm::vec3 dir;
+					lightDirection(light, results[r].coord, dir, dist[num_shadow]);
+					shadow_rays[num_shadow++] = Ray(results[r].coord, dir);
+				}
+
+				if (packet_size > 0)
+					shadowed[band] += __builtin_popcount(occludedPacket(shadow_rays, dist, num_shadow, scene));
+				else
+					for (int s = 0; s < num_shadow; s++)
+						shadowed[band] += occluded(shadow_rays[s].origin, shadow_rays[s].direction, dist[s], scene);
+			}
+		}
+	});
+	double seconds = secondsSince(start);
+
+	total_hits = total_shadowed = 0;
+	for (int band = 0; band < bands; band++)
+	{
+		total_hits += hits[band];
+		total_shadowed += shadowed[band];
+	}
+	return seconds;
+}
+
+// primary and shadow rays traced one at a time and in packets of 8 and 16
+static int benchPackets(const char *scenefile)
+{
+	Scene scene;
+	scene.readfile(scenefile);
+	scene.buildBVH();
+	cout << scene.mesh.size() << " triangles, " << scene.spheres.size() << " spheres, " << scene.lights.size()
+		 << " lights, " << scene.width << "x" << scene.height << " pixels, " << Scheduler::hardwareThreads()
+		 << " threads\n";
+
+	Scheduler scheduler(Scheduler::hardwareThreads());
+	for (int packet_size : {0, RayPacket::width, max_packet_size})
+	{
+		long total_hits = 0, total_shadowed = 0;
+		double trace = 0;
+		for (int run = 0; run < 5; run++)
+		{
+			bvh_node_tests = 0;
+			double time = tracePacketFrame(scene, scheduler, packet_size, total_hits, total_shadowed);
+			if (run == 0 || time < trace)
+				trace = time;
+		}
+		long rays = (long)scene.width * scene.height + total_hits * scene.lights.size();
+
+		cout << (packet_size ? "packets of " + std::to_string(packet_size) : string("single rays  ")) << " trace "
+			 << trace * 1e3 << " ms, " << (double)bvh_node_tests / rays << " node tests per ray, " << total_hits
+			 << " hits, " << total_shadowed << " shadowed\n";
+	}
+	return 0;
+}
+
+// the mirror reflection rays off the primary hits of every 16x16 tile of
+// the image, the secondary rays of the wavefront integrator, traced in
+// packets of 16. collected first, so only the tracing is timed, in the
+// order they were spawned and sorted by sortRays
+static double traceReflections(const Scene &scene, Scheduler &scheduler, bool sorted, double &sort_seconds, long &total_rays,
+							   long &total_hits)
+{
+	const int tile = 16;
+	RayGenerator camera(scene.cam, scene.width, scene.height);
+	int tiles_x = (scene.width + tile - 1) / tile;
+	int tiles_y = (scene.height + tile - 1) / tile;
+
+	std::vector<std::vector<Ray>> batches(tiles_x * tiles_y);
+	scheduler.run(tiles_x * tiles_y, [&](int t, int) {
+		int i_begin = (t / tiles_x) * tile, j_begin = (t % tiles_x) * tile;
+		for (int i = i_begin; i < std::min(i_begin + tile, scene.height); i++)
+			for (int j = j_begin; j < std::min(j_begin + tile, scene.width); j++)
+			{
+				Ray ray = camera.ray(i, j);
+				Intersection hit;
+				hit.intersect(ray, scene);
+				if (!hit.isIntersected)
+					continue;
+				glm::vec3 norm = hit.normal(scene);
+				batches[t].push_back(Ray(hit.coord, ray.direction - norm * (2 * glm::dot(ray.direction, norm))));
+			}
+	});
+
+	Clock::time_point start = Clock::now();
+	std::vector<RaySortScratch> scratch(scheduler.threads());
+	std::vector<std::vector<int>> ids(scheduler.threads());
+	if (sorted)
+		scheduler.run(batches.size(), [&](int t, int worker) {
+			ids[worker].resize(batches[t].size());
+			sortRays(batches[t].data(), ids[worker].data(), batches[t].size(), scratch[worker]);
+		});
+	sort_seconds = secondsSince(start);
+
+	std::vector<long> hits(batches.size());
+	start = Clock::now();
+	scheduler.run(batches.size(), [&](int t, int) {
+		const std::vector<Ray> &rays = batches[t];
+		Intersection results[max_packet_size];
+		for (size_t r = 0; r < rays.size(); r += max_packet_size)
+		{
+			int count = std::min(max_packet_size, (int)(rays.size() - r));
+			intersectPacket(&rays[r], count, results, scene);
+			for (int k = 0; k < count; k++)
+				hits[t] += results[k].isIntersected;
+		}
+	});
+	double seconds = secondsSince(start);
+
+	total_rays = total_hits = 0;
+	for (size_t t = 0; t < batches.size(); t++)
+	{
+		total_rays += batches[t].size();
+		total_hits += hits[t];
+	}
+	return seconds;
+}
+
+// reflection rays traced in the order they were spawned and sorted by
+// direction octant and origin
+static int benchSort(const char *scenefile)
+{
+	Scene scene;
+	scene.readfile(scenefile);
+	scene.buildBVH();
+	cout << scene.mesh.size() << " triangles, " << scene.spheres.size() << " spheres, " << scene.width << "x"
+		 << scene.height << " pixels, " << Scheduler::hardwareThreads() << " threads\n";
+
+	Scheduler scheduler(Scheduler::hardwareThreads());
+	for (bool sorted : {false, true})
+	{
+		long total_rays = 0, total_hits = 0, node_tests = 0, node_fetches = 0;
+		double trace = 0, sort = 0;
+		for (int run = 0; run < 5; run++)
+		{
+			double sort_seconds;
+			bvh_node_tests = 0;
+			bvh_node_fetches = 0;
+			double time = traceReflections(scene, scheduler, sorted, sort_seconds, total_rays, total_hits);
+			node_tests = bvh_node_tests;
+			node_fetches = bvh_node_fetches;
+			if (run == 0 || time < trace)
+			{
+				trace = time;
+				sort = sort_seconds;
+			}
+		}
+		cout << (sorted ? "sorted  " : "unsorted") << " trace " << trace * 1e3 << " ms";
+		if (sorted)
+			cout << " + sort " << sort * 1e3 << " ms";
+		cout << ", " << (double)node_fetches / total_rays << " node fetches and " << (double)node_tests / total_rays
+			 << " node tests per ray, " << total_rays << " rays, " << total_hits << " hits\n";
+	}
+	return 0;
+}
+
+static int benchBVH(const char *scenefile)
+{
+	Scene scene;
+	scene.readfile(scenefile);
+	cout << scene.mesh.size() << " triangles, " << scene.spheres.size() << " spheres, "
+		 << scene.width << "x" << scene.height << " pixels, " << Scheduler::hardwareThreads() << " threads\n";
+
+	Scheduler scheduler(Scheduler::hardwareThreads());
+	struct Config
+	{
+		BVH::Method method;
+		int width;
+		bool quantize;
+	};
+	const Config configs[] = {
+		{BVH::sweep, 8, false},
+		{BVH::binned, 2, false},
+		{BVH::binned, 4, false},
+		{BVH::binned, 8, false},
+		{BVH::binned, 4, true},
+		{BVH::binned, 8, true},
+		{BVH::lbvh, 8, false},
+		{BVH::sbvh, 8, false},
+	};
+	for (const Config &config : configs)
+	{
+		BVH::Options options;
+		options.method = config.method;
+		options.width = config.width;
+		options.quantize = config.quantize;
+
+		double build = 0;
+		for (int run = 0; run < 3; run++)
+		{
+			Clock::time_point start = Clock::now();
+			scene.buildBVH(options);
+			double time = secondsSince(start);
+			if (run == 0 || time < build)
+				build = time;
+		}
+
+		long total_hits, total_shadowed;
+		bvh_node_tests = 0;
+		double trace = traceFrame(scene, scheduler, total_hits, total_shadowed);
+		long rays = (long)scene.width * scene.height + total_hits * scene.lights.size();
+
+		const char *name = BVH::methodName(config.method);
+		cout << name << string(8 - strlen(name), ' ') << "x" << config.width << (config.quantize ? "q" : " ")
+			 << " build " << build * 1e3 << " ms, trace " << trace * 1e3 << " ms, total "
+			 << (build + trace) * 1e3 << " ms, SAH cost " << scene.bvh.cost() << ", "
+			 << scene.bvh.nodeMemory() / 1024 << " KB nodes, " << (double)bvh_node_tests / rays
+			 << " node tests per ray, " << total_hits << " hits, " << total_shadowed << " shadowed\n";
+	}
+	return 0;
+}
+
+// rigid body animation: over the frames, some of the spheres and
+// instances drift half way around circles, the instances also spinning
+// about their centers.
+// the top level BVH is refit, or rebuilt once its cost degrades, and
+// compared with building it from scratch every frame. once with a single
+// object moving and once with all of them
+static int benchRefit(const char *scenefile, int frames)
+{
+	Scene scene;
+	scene.readfile(scenefile);
+	int num_objects = scene.spheres.size() + scene.instances.size();
+	cout << scene.mesh.size() << " triangles, " << scene.spheres.size() << " spheres, " << scene.instances.size()
+		 << " instances, " << frames << " frames\n";
+	if (num_objects == 0)
+	{
+		cerr << "No spheres or instances to move\n";
+		return -1;
+	}
+
+	BVH::Options options;
+	scene.buildBVH(options);
+	const std::vector<Sphere> spheres = scene.spheres;
+	const std::vector<Instance> instances = scene.instances;
+	AABB world = scene.bvh.bounds();
+	float radius = 0.05f * glm::length(world.hi - world.lo);
+	int first_sphere = scene.mesh.size();
+
+	Scheduler scheduler(Scheduler::hardwareThreads());
+	for (int moving : {1, num_objects})
+	{
+		scene.spheres = spheres;
+		scene.instances = instances;
+		scene.bvh.build(scene.mesh, scene.spheres, scene.instances, options);
+
+		double refit = 0, build = 0;
+		int rebuilds = 0;
+		BVH built;
+		for (int frame = 1; frame <= frames; frame++)
+		{
+			float angle = glm::pi<float>() * frame / frames;
+			std::vector<int> moved;
+			for (int k = 0; k < moving; k++)
+			{
+				float phase = 2.4f * k;
+				glm::vec3 offset = radius * glm::vec3(glm::cos(angle + phase) - glm::cos(phase), 0.0f,
+													  glm::sin(angle + phase) - glm::sin(phase));
+				if (k < (int)spheres.size())
+					scene.spheres[k].center = spheres[k].center + offset;
+				else
+				{
+					const Instance &instance = instances[k - spheres.size()];
+					glm::vec3 center = instance.bounds.centroid();
+					glm::mat4 M = glm::translate(glm::mat4(1.0f), center + offset) *
+								  glm::rotate(glm::mat4(1.0f), angle, glm::vec3(0.0f, 1.0f, 0.0f)) *
+								  glm::translate(glm::mat4(1.0f), -center) * instance.trans;
+					scene.instances[k - spheres.size()] = Instance(instance.shape, M);
+				}
+				moved.push_back(first_sphere + k);
+			}
+
+			Clock::time_point start = Clock::now();
+			rebuilds += scene.updateBVH(moved, options);
+			refit += secondsSince(start);
+
+			start = Clock::now();
+			built.build(scene.mesh, scene.spheres, scene.instances, options);
+			build += secondsSince(start);
+		}
+
+		long hits, shadowed, built_hits, built_shadowed;
+		float cost = scene.bvh.cost();
+		double trace = traceFrame(scene, scheduler, hits, shadowed);
+		std::swap(scene.bvh, built);
+		double built_trace = traceFrame(scene, scheduler, built_hits, built_shadowed);
+		std::swap(scene.bvh, built);
+
+		cout << moving << " moving: refit " << refit / frames * 1e3 << " ms per frame (" << rebuilds
+			 << " rebuilds), build " << build / frames * 1e3 << " ms per frame; last frame SAH cost "
+			 << cost << " refit vs " << built.cost() << " built, trace " << trace * 1e3 << " ms vs "
+			 << built_trace * 1e3 << " ms" << (hits == built_hits && shadowed == built_shadowed ? "" : ", HITS DIFFER")
+			 << "\n";
+	}
+
+	// a BVH loaded from the cache refits like a built one: the instances
+	// that do not move keep their bounds. the last instance moves once
+	if (!instances.empty())
+	{
+		const char *cache_file = "bench-refit.bvh";
+		Scene built_scene, cached_scene;
+		built_scene.readfile(scenefile);
+		cached_scene.readfile(scenefile);
+		built_scene.buildBVH(options);
+		uint64_t hash = built_scene.geometryHash(options);
+		double build_seconds;
+		bool loaded = built_scene.saveBVH(cache_file, hash, 0.0) && cached_scene.loadBVH(cache_file, hash, build_seconds);
+		remove(cache_file);
+		if (!loaded)
+		{
+			cerr << "Could not save and load the BVH cache\n";
+			return -1;
+		}
+
+		int last = instances.size() - 1;
+		glm::mat4 M = glm::translate(glm::mat4(1.0f), glm::vec3(radius, 0.0f, 0.0f)) * instances[last].trans;
+		built_scene.instances[last] = cached_scene.instances[last] = Instance(instances[last].shape, M);
+		built_scene.buildBVH(options);
+		bool rebuilt = cached_scene.updateBVH(std::vector<int>(1, first_sphere + spheres.size() + last), options);
+
+		long hits, shadowed, built_hits, built_shadowed;
+		traceFrame(cached_scene, scheduler, hits, shadowed);
+		traceFrame(built_scene, scheduler, built_hits, built_shadowed);
+		cout << "cache load then " << (rebuilt ? "rebuild" : "refit") << ": " << hits << " hits vs " << built_hits
+			 << " built" << (hits == built_hits && shadowed == built_shadowed ? "" : ", HITS DIFFER") << "\n";
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	string mode = argc > 1 ? argv[1] : "";
+
+	if (mode == "kernel" && argc == 3)
+		return benchKernel(argv[2]);
+	if (mode == "parse" && argc == 3)
+		return benchParse(argv[2]);
+	if (mode == "bvh" && argc == 3)
+		return benchBVH(argv[2]);
+	if (mode == "packets" && argc == 3)
+		return benchPackets(argv[2]);
+	if (mode == "sort" && argc == 3)
+		return benchSort(argv[2]);
+	if (mode == "refit" && (argc == 3 || argc == 4))
+		return benchRefit(argv[2], argc == 4 ? std::max(atoi(argv[3]), 1) : 60);
+	if (mode == "build" && (argc == 3 || argc == 4))
+		return benchBuild(argv[2], argc == 4 ? std::max(atoi(argv[3]), 1) : Scheduler::hardwareThreads());
+
+	cerr << "Usage: bench kernel|parse|build|bvh|packets|sort scene.test [max_threads]\n";
+	cerr << "       bench refit scene.test [frames]\n";
+	return -1;
+}
@@ -0,0 +1,1401 @@
+#include <algorithm>
+#include <atomic>
+#include <numeric>
+#include <queue>
+#include <thread>
+
+#include "bvh.h"
+#include "scheduler.h"
+
+const int max_leaf_size = TriBlock::width;
+const int max_depth = 60;          // keeps traversal stacks bounded
+const float traversal_cost = 1.0f; // relative to the cost of testing one block
+const int num_bins = 32;           // per axis in the binned builder
+const int min_parallel_count = 4096; // smaller ranges are left to one thread
+const float min_split_overlap = 1e-5f; // of the root area, below which spatial splits are not tried
+
+// leaves are tested a block of triangles at a time
+static float leafCost(int count)
+{
+    return (float)((count + TriBlock::width - 1) / TriBlock::width);
+}
+
+// call fn(chunk, begin, end) for num_chunks contiguous chunks of
+// [begin, end), each on its own thread
+template <class F>
+static void parallelChunks(int num_chunks, int begin, int end, const F &fn)
+{
+    std::vector<std::thread> threads;
+    for (int c = 1; c < num_chunks; c++)
+    {
+        int chunk_begin = begin + (long long)(end - begin) * c / num_chunks;
+        int chunk_end = begin + (long long)(end - begin) * (c + 1) / num_chunks;
+        threads.emplace_back([&fn, c, chunk_begin, chunk_end]() { fn(c, chunk_begin, chunk_end); });
+    }
+    fn(0, begin, begin + (end - begin) / num_chunks);
+    for (std::thread &t : threads)
+        t.join();
+}
+
+// hits are accepted slightly outside of a primitive (see the epsilon in
+// Triangle::hit), so boxes are padded by this much to never cull one of them
+static float padding(const AABB &box)
+{
+    glm::vec3 extent = box.hi - box.lo;
+    glm::vec3 magnitude = glm::max(glm::abs(box.lo), glm::abs(box.hi));
+    return 1e-3f * std::max(std::max(extent.x, extent.y), extent.z) +
+           1e-5f * std::max(std::max(magnitude.x, magnitude.y), magnitude.z) + 1e-6f;
+}
+
+// box of primitive p, padded
+static AABB primitiveBounds(int p, const Mesh &mesh, const std::vector<Sphere> &spheres,
+                            const std::vector<Instance> &instances)
+{
+    int num_triangles = mesh.size(), num_spheres = spheres.size();
+    AABB box = p < num_triangles               ? mesh.bounds(p)
+               : p < num_triangles + num_spheres ? spheres[p - num_triangles].bounds()
+                                                 : instances[p - num_triangles - num_spheres].bounds;
+    float pad = padding(box);
+    box.lo -= glm::vec3(pad);
+    box.hi += glm::vec3(pad);
+    return box;
+}
+
+// leaves cover all of their primitives until packBlocks moves the triangles out
+static void makeLeaf(BVHNode &node, int begin, int end)
+{
+    node.first = begin;
+    node.count = end - begin;
+    node.block = 0;
+    node.blocks = 0;
+}
+
+// turn the binary tree into nodes of up to width children, in depth first
+// order. a node starts out with the two children of its binary node and
+// keeps opening the child with the largest surface area until it has
+// width of them or only leaves
+template <class Node>
+static void collapse(const std::vector<BVHNode> &tree, int width, std::vector<Node> &nodes, std::vector<BVHLeaf> &leaves)
+{
+    // pairs of a binary node and the node it becomes
+    std::vector<std::pair<int, int>> stack;
+    nodes.push_back(Node());
+    stack.push_back(std::make_pair(0, 0));
+    while (!stack.empty())
+    {
+        std::pair<int, int> entry = stack.back();
+        stack.pop_back();
+
+        // a leaf root becomes the only child of the root
+        int children[WideNode::width];
+        int count = 0;
+        const BVHNode &binary = tree[entry.first];
+        if (binary.isLeaf())
+            children[count++] = entry.first;
+        else
+        {
+            children[count++] = binary.first;
+            children[count++] = binary.first + 1;
+        }
+
+        while (count < width)
+        {
+            int largest = -1;
+            for (int i = 0; i < count; i++)
+                if (!tree[children[i]].isLeaf() &&
+                    (largest < 0 || tree[children[i]].bounds.area() > tree[children[largest]].bounds.area()))
+                    largest = i;
+            if (largest < 0)
+                break;
+            int opened = children[largest];
+            children[largest] = tree[opened].first;
+            children[count++] = tree[opened].first + 1;
+        }
+
+        nodes[entry.second].setBounds(binary.bounds);
+        for (int i = 0; i < count; i++)
+        {
+            const BVHNode &child = tree[children[i]];
+            int index;
+            if (child.isLeaf())
+            {
+                index = ~(int)leaves.size();
+                leaves.push_back(BVHLeaf{child.first, child.count, child.block, child.blocks});
+            }
+            else
+            {
+                index = nodes.size();
+                nodes.push_back(Node());
+                stack.push_back(std::make_pair(children[i], index));
+            }
+            nodes[entry.second].set(i, child.bounds, index);
+        }
+    }
+}
+
+void BVH::build(const Mesh &mesh, const std::vector<Sphere> &spheres, const std::vector<Instance> &instances,
+                const Options &options, int num_threads)
+{
+    nodes.clear();
+    quantized_nodes.clear();
+    spatial_splits = 0;
+    refit_state = RefitState();
+    leaves.clear();
+    indices.clear();
+    blocks.clear();
+    num_triangles = mesh.size();
+    num_spheres = spheres.size();
+
+    int n = mesh.size() + spheres.size() + instances.size();
+    if (n == 0)
+        return;
+
+    Method method = options.method;
+    if (num_threads <= 0)
+        num_threads = Scheduler::hardwareThreads();
+    if (method == sweep || method == sbvh)
+        num_threads = 1;
+
+    boxes.resize(n);
+    centroids.resize(n);
+    int chunks = std::max(std::min(num_threads, n / min_parallel_count), 1);
+    parallelChunks(chunks, 0, n, [&](int, int begin, int end) {
+        for (int i = begin; i < end; i++)
+        {
+            boxes[i] = primitiveBounds(i, mesh, spheres, instances);
+            centroids[i] = boxes[i].centroid();
+        }
+    });
+
+    indices.resize(n);
+    std::iota(indices.begin(), indices.end(), 0);
+
+    if (method == binned)
+        buildBinned(num_threads);
+    else if (method == lbvh)
+        buildLBVH(num_threads);
+    else if (method == sbvh)
+        buildSpatial(mesh, options.split_budget);
+    else
+    {
+        tree.reserve(2 * n);
+        tree.push_back(BVHNode());
+        subdivide(0, 0, n, 0);
+    }
+    packBlocks(mesh);
+
+    int width = std::min(std::max(options.width, 2), WideNode::width);
+    if (options.quantize)
+        collapse(tree, width, quantized_nodes, leaves);
+    else
+        collapse(tree, width, nodes, leaves);
+
+    tree.clear();
+    tree.shrink_to_fit();
+    boxes.clear();
+    boxes.shrink_to_fit();
+    centroids.clear();
+    centroids.shrink_to_fit();
+}
+
+// build the subtree for indices[begin, end) into tree[node_index]
+void BVH::subdivide(int node_index, int begin, int end, int depth)
+{
+    AABB bounds, centroid_bounds;
+    for (int i = begin; i < end; i++)
+    {
+        bounds.grow(boxes[indices[i]]);
+        centroid_bounds.grow(centroids[indices[i]]);
+    }
+    tree[node_index].bounds = bounds;
+
+    int count = end - begin;
+    if (count == 1 || depth >= max_depth)
+    {
+        makeLeaf(tree[node_index], begin, end);
+        return;
+    }
+
+    // order along an axis, ties broken by index so the build is deterministic
+    int sorted_axis = -1;
+    auto sortAlong = [&](int axis) {
+        sorted_axis = axis;
+        std::sort(indices.begin() + begin, indices.begin() + end, [&](int a, int b) {
+            float ca = centroids[a][axis], cb = centroids[b][axis];
+            return ca < cb || (ca == cb && a < b);
+        });
+    };
+
+    // sweep the objects sorted along each axis for the cheapest split
+    float best_cost = std::numeric_limits<float>::max();
+    int best_axis = -1;
+    int best_split = count / 2;
+
+    std::vector<float> right_area(count);
+    float inv_area = 1.0f / bounds.area();
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (centroid_bounds.lo[axis] == centroid_bounds.hi[axis])
+            continue; // all centroids in one plane, nothing to split
+
+        sortAlong(axis);
+
+        AABB right;
+        for (int i = count - 1; i > 0; i--)
+        {
+            right.grow(boxes[indices[begin + i]]);
+            right_area[i] = right.area();
+        }
+
+        AABB left;
+        for (int i = 1; i < count; i++)
+        {
+            left.grow(boxes[indices[begin + i - 1]]);
+            float cost = traversal_cost + (left.area() * leafCost(i) + right_area[i] * leafCost(count - i)) * inv_area;
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = i;
+            }
+        }
+    }
+
+    if (count <= max_leaf_size && (best_axis < 0 || best_cost >= leafCost(count)))
+    {
+        makeLeaf(tree[node_index], begin, end);
+        return;
+    }
+
+    if (best_axis >= 0 && best_axis != sorted_axis)
+        sortAlong(best_axis);
+
+    int left = tree.size();
+    tree.push_back(BVHNode());
+    tree.push_back(BVHNode());
+    tree[node_index].first = left;
+    tree[node_index].count = 0;
+    tree[node_index].blocks = 0;
+
+    subdivide(left, begin, begin + best_split, depth + 1);
+    subdivide(left + 1, begin + best_split, end, depth + 1);
+}
+
+class Bin
+{
+public:
+    AABB box; // of the primitives
+    AABB centroids;
+    int count = 0;
+
+    void grow(const Bin &other)
+    {
+        box.grow(other.box);
+        centroids.grow(other.centroids);
+        count += other.count;
+    }
+};
+
+// state shared by the threads of a binned build. every node is split at
+// the cheapest of the 31 bin boundaries per axis. large ranges are binned
+// by several threads at once, and the two halves of a split are built
+// concurrently while there are threads to spare. the nodes are allocated
+// with an atomic counter and put in depth first order afterwards
+class BinnedBuild
+{
+public:
+    const std::vector<AABB> &boxes;
+    const std::vector<glm::vec3> &centroids;
+    std::vector<int> &indices;
+    std::vector<BVHNode> &nodes;
+    std::atomic<int> num_nodes;
+
+    BinnedBuild(const std::vector<AABB> &boxes, const std::vector<glm::vec3> &centroids,
+                std::vector<int> &indices, std::vector<BVHNode> &nodes)
+        : boxes(boxes), centroids(centroids), indices(indices), nodes(nodes), num_nodes(1) {}
+
+    void subdivide(int node_index, int begin, int end, int depth, const Bin &range, int threads);
+
+private:
+    void binRange(int begin, int end, const AABB &centroid_bounds, Bin (*bins)[num_bins]) const;
+};
+
+// bins per unit along axis, 0 if the centroids cannot be split along it
+static inline float binScale(const AABB &centroid_bounds, int axis)
+{
+    float scale = num_bins / (centroid_bounds.hi[axis] - centroid_bounds.lo[axis]);
+    return scale < std::numeric_limits<float>::infinity() ? scale : 0.0f;
+}
+
+static inline int binOf(float centroid, float lo, float scale)
+{
+    int bin = (int)((centroid - lo) * scale);
+    return std::min(std::max(bin, 0), num_bins - 1);
+}
+
+void BinnedBuild::binRange(int begin, int end, const AABB &centroid_bounds, Bin (*bins)[num_bins]) const
+{
+    glm::vec3 scale(binScale(centroid_bounds, 0), binScale(centroid_bounds, 1), binScale(centroid_bounds, 2));
+    for (int i = begin; i < end; i++)
+    {
+        int p = indices[i];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (scale[axis] == 0.0f)
+                continue;
+            Bin &bin = bins[axis][binOf(centroids[p][axis], centroid_bounds.lo[axis], scale[axis])];
+            bin.box.grow(boxes[p]);
+            bin.centroids.grow(centroids[p]);
+            bin.count++;
+        }
+    }
+}
+
+// build the subtree for indices[begin, end) into nodes[node_index]. range
+// holds the bounds and centroid bounds of those primitives
+void BinnedBuild::subdivide(int node_index, int begin, int end, int depth, const Bin &range, int threads)
+{
+    BVHNode &node = nodes[node_index];
+    node.bounds = range.box;
+
+    int count = end - begin;
+    if (count == 1 || depth >= max_depth)
+    {
+        makeLeaf(node, begin, end);
+        return;
+    }
+
+    // bin the primitives along every axis, with several threads if it is worth it.
+    // bins only take minima, maxima and counts, so the result is the same
+    Bin bins[3][num_bins];
+    int chunks = std::min(threads, count / min_parallel_count);
+    if (chunks > 1)
+    {
+        std::vector<Bin> partial(chunks * 3 * num_bins);
+        parallelChunks(chunks, begin, end, [&](int chunk, int chunk_begin, int chunk_end) {
+            binRange(chunk_begin, chunk_end, range.centroids, (Bin(*)[num_bins]) & partial[chunk * 3 * num_bins]);
+        });
+        for (int chunk = 0; chunk < chunks; chunk++)
+            for (int axis = 0; axis < 3; axis++)
+                for (int b = 0; b < num_bins; b++)
+                    bins[axis][b].grow(partial[(chunk * 3 + axis) * num_bins + b]);
+    }
+    else
+        binRange(begin, end, range.centroids, bins);
+
+    // sweep the bin boundaries for the cheapest split
+    float best_cost = std::numeric_limits<float>::max();
+    int best_axis = -1;
+    int best_bin = 0;
+
+    float inv_area = 1.0f / range.box.area();
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (binScale(range.centroids, axis) == 0.0f)
+            continue; // all centroids in one plane, nothing to split
+
+        float right_area[num_bins];
+        int right_count[num_bins];
+        Bin right;
+        for (int b = num_bins - 1; b > 0; b--)
+        {
+            right.grow(bins[axis][b]);
+            right_area[b] = right.count > 0 ? right.box.area() : 0.0f;
+            right_count[b] = right.count;
+        }
+
+        Bin left;
+        for (int b = 1; b < num_bins; b++)
+        {
+            left.grow(bins[axis][b - 1]);
+            if (left.count == 0 || right_count[b] == 0)
+                continue;
+            float cost = traversal_cost + (left.box.area() * leafCost(left.count) +
+                                           right_area[b] * leafCost(right_count[b])) * inv_area;
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    if (count <= max_leaf_size && (best_axis < 0 || best_cost >= leafCost(count)))
+    {
+        makeLeaf(node, begin, end);
+        return;
+    }
+
+    int middle;
+    Bin left, right;
+    if (best_axis >= 0)
+    {
+        float lo = range.centroids.lo[best_axis], scale = binScale(range.centroids, best_axis);
+        middle = std::partition(indices.begin() + begin, indices.begin() + end, [&](int p) {
+                     return binOf(centroids[p][best_axis], lo, scale) < best_bin;
+                 }) - indices.begin();
+        for (int b = 0; b < num_bins; b++)
+            (b < best_bin ? left : right).grow(bins[best_axis][b]);
+    }
+    else
+    {
+        // too many primitives with centroids too close to bin, split them
+        // in the middle of the range
+        middle = begin + count / 2;
+        for (int i = begin; i < end; i++)
+        {
+            Bin &side = i < middle ? left : right;
+            side.box.grow(boxes[indices[i]]);
+            side.centroids.grow(centroids[indices[i]]);
+        }
+        left.count = middle - begin;
+        right.count = end - middle;
+    }
+
+    int first = num_nodes.fetch_add(2);
+    node.first = first;
+    node.count = 0;
+    node.blocks = 0;
+
+    // share the threads by the size of the halves
+    if (threads > 1 && count >= min_parallel_count)
+    {
+        int left_threads = std::min(std::max((int)((long long)threads * left.count / count), 1), threads - 1);
+        std::thread left_builder([&]() { subdivide(first, begin, middle, depth + 1, left, left_threads); });
+        subdivide(first + 1, middle, end, depth + 1, right, threads - left_threads);
+        left_builder.join();
+    }
+    else
+    {
+        subdivide(first, begin, middle, depth + 1, left, 1);
+        subdivide(first + 1, middle, end, depth + 1, right, 1);
+    }
+}
+
+void BVH::buildBinned(int num_threads)
+{
+    int n = indices.size();
+    Bin range;
+    int chunks = std::max(std::min(num_threads, n / min_parallel_count), 1);
+    std::vector<Bin> partial(chunks);
+    parallelChunks(chunks, 0, n, [&](int chunk, int begin, int end) {
+        for (int i = begin; i < end; i++)
+        {
+            partial[chunk].box.grow(boxes[i]);
+            partial[chunk].centroids.grow(centroids[i]);
+        }
+    });
+    for (const Bin &bin : partial)
+        range.grow(bin);
+    range.count = n;
+
+    tree.resize(2 * n);
+    BinnedBuild build(boxes, centroids, indices, tree);
+    build.subdivide(0, 0, n, 0, range, num_threads);
+    tree.resize(build.num_nodes);
+    reorder();
+}
+
+// spread the low 21 bits of x out to every third bit
+static inline uint64_t spreadBits(uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffull;
+    x = (x | x << 16) & 0x1f0000ff0000ffull;
+    x = (x | x << 8) & 0x100f00f00f00f00full;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
+
+// sort values by their 63-bit keys, 8 bits per pass. passes where all
+// keys have the same digit are skipped
+static void radixSort(std::vector<uint64_t> &keys, std::vector<int> &values)
+{
+    int n = keys.size();
+    std::vector<uint64_t> keys_out(n);
+    std::vector<int> values_out(n);
+    for (int shift = 0; shift < 64; shift += 8)
+    {
+        int offsets[256] = {};
+        for (uint64_t key : keys)
+            offsets[(key >> shift) & 0xff]++;
+        if (offsets[(keys[0] >> shift) & 0xff] == n)
+            continue;
+
+        int sum = 0;
+        for (int &offset : offsets)
+        {
+            int count = offset;
+            offset = sum;
+            sum += count;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            int position = offsets[(keys[i] >> shift) & 0xff]++;
+            keys_out[position] = keys[i];
+            values_out[position] = values[i];
+        }
+        keys.swap(keys_out);
+        values.swap(values_out);
+    }
+}
+
+// inner node of the binary radix tree over the sorted codes, covering the
+// sorted primitives [begin, end]. the left child covers [begin, split] and
+// is inner node split unless that is a single primitive, the right child
+// covers [split + 1, end] and is inner node split + 1 unless it is single
+class RadixNode
+{
+public:
+    int begin, end, split;
+};
+
+// state of a Morton code build (LBVH). the primitives are sorted along a
+// Morton curve through their centroids, and the radix tree over those
+// codes is the hierarchy: every inner node is found on its own from the
+// codes around it (Karras 2012), so all of them are computed in parallel.
+// the tree is then turned into BVH nodes top down, small subtrees
+// collapsed into leaves, with subtrees emitted on their own threads
+class LBVHBuild
+{
+public:
+    const std::vector<AABB> &boxes;
+    const std::vector<int> &indices;
+    std::vector<BVHNode> &nodes;
+    std::vector<uint64_t> codes; // sorted like indices
+    std::vector<RadixNode> radix_nodes;
+    std::atomic<int> num_nodes;
+
+    LBVHBuild(const std::vector<AABB> &boxes, const std::vector<int> &indices, std::vector<BVHNode> &nodes)
+        : boxes(boxes), indices(indices), nodes(nodes), num_nodes(1) {}
+
+    void radixNode(int i);
+    void emit(int node_index, int begin, int end, int depth, int threads);
+
+private:
+    int delta(int i, int j) const;
+};
+
+// length of the common prefix of codes i and j, -1 if j is out of range.
+// equal codes are told apart by their positions
+int LBVHBuild::delta(int i, int j) const
+{
+    if (j < 0 || j >= (int)codes.size())
+        return -1;
+    if (codes[i] == codes[j])
+        return 64 + __builtin_clz((uint32_t)(i ^ j));
+    return __builtin_clzll(codes[i] ^ codes[j]);
+}
+
+void LBVHBuild::radixNode(int i)
+{
+    // direction of the range, and its other end by binary search
+    int d = delta(i, i + 1) > delta(i, i - 1) ? 1 : -1;
+    int delta_min = delta(i, i - d);
+    int length_max = 2;
+    while (delta(i, i + length_max * d) > delta_min)
+        length_max *= 2;
+    int length = 0;
+    for (int t = length_max / 2; t >= 1; t /= 2)
+        if (delta(i, i + (length + t) * d) > delta_min)
+            length += t;
+    int j = i + length * d;
+
+    // split where the common prefix gets longer
+    int delta_node = delta(i, j);
+    int s = 0;
+    int t = length;
+    do
+    {
+        t = (t + 1) / 2;
+        if (delta(i, i + (s + t) * d) > delta_node)
+            s += t;
+    } while (t > 1);
+
+    radix_nodes[i].begin = std::min(i, j);
+    radix_nodes[i].end = std::max(i, j);
+    radix_nodes[i].split = i + s * d + std::min(d, 0);
+}
+
+// emit the sorted primitives [begin, end) into nodes[node_index]. ranges
+// of more than one primitive are the radix tree node that starts or ends
+// there. bounds are filled in on the way back up
+void LBVHBuild::emit(int node_index, int begin, int end, int depth, int threads)
+{
+    BVHNode &node = nodes[node_index];
+    int count = end - begin;
+    if (count <= max_leaf_size || depth >= max_depth)
+    {
+        AABB bounds;
+        for (int i = begin; i < end; i++)
+            bounds.grow(boxes[indices[i]]);
+        node.bounds = bounds;
+        makeLeaf(node, begin, end);
+        return;
+    }
+
+    // the inner node of [begin, end) is begin if it is a right child, else end - 1
+    const RadixNode &radix = radix_nodes[radix_nodes[begin].begin == begin && radix_nodes[begin].end == end - 1 ? begin : end - 1];
+    int middle = radix.split + 1;
+
+    int first = num_nodes.fetch_add(2);
+    node.first = first;
+    node.count = 0;
+    node.blocks = 0;
+
+    if (threads > 1 && count >= min_parallel_count)
+    {
+        int left_threads = std::min(std::max((int)((long long)threads * (middle - begin) / count), 1), threads - 1);
+        std::thread left_builder([&]() { emit(first, begin, middle, depth + 1, left_threads); });
+        emit(first + 1, middle, end, depth + 1, threads - left_threads);
+        left_builder.join();
+    }
+    else
+    {
+        emit(first, begin, middle, depth + 1, 1);
+        emit(first + 1, middle, end, depth + 1, 1);
+    }
+
+    node.bounds = nodes[first].bounds;
+    node.bounds.grow(nodes[first + 1].bounds);
+}
+
+void BVH::buildLBVH(int num_threads)
+{
+    int n = indices.size();
+    int chunks = std::max(std::min(num_threads, n / min_parallel_count), 1);
+
+    // quantize the centroids to 21 bits per axis within their bounds
+    std::vector<AABB> partial(chunks);
+    parallelChunks(chunks, 0, n, [&](int chunk, int begin, int end) {
+        for (int i = begin; i < end; i++)
+            partial[chunk].grow(centroids[i]);
+    });
+    AABB centroid_bounds;
+    for (const AABB &box : partial)
+        centroid_bounds.grow(box);
+
+    glm::vec3 scale;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        scale[axis] = 2097151.0f / (centroid_bounds.hi[axis] - centroid_bounds.lo[axis]);
+        if (!(scale[axis] < std::numeric_limits<float>::infinity()))
+            scale[axis] = 0.0f;
+    }
+
+    tree.resize(2 * n);
+    LBVHBuild build(boxes, indices, tree);
+    build.codes.resize(n);
+    parallelChunks(chunks, 0, n, [&](int, int begin, int end) {
+        for (int i = begin; i < end; i++)
+        {
+            glm::vec3 q = glm::min((centroids[i] - centroid_bounds.lo) * scale, glm::vec3(2097151.0f));
+            build.codes[i] = spreadBits((uint64_t)q.x) << 2 | spreadBits((uint64_t)q.y) << 1 | spreadBits((uint64_t)q.z);
+        }
+    });
+    radixSort(build.codes, indices);
+
+    build.radix_nodes.resize(std::max(n - 1, 0));
+    parallelChunks(chunks, 0, n - 1, [&](int, int begin, int end) {
+        for (int i = begin; i < end; i++)
+            build.radixNode(i);
+    });
+
+    build.emit(0, 0, n, 0, num_threads);
+    tree.resize(build.num_nodes);
+    reorder();
+}
+
+// a primitive, or the part of it within a node after spatial splits
+class Reference
+{
+public:
+    AABB box;
+    int primitive;
+};
+
+// bin of a spatial split, holding the parts of the references that fall
+// in it. entries and exits count the references starting and ending in it
+class SpatialBin
+{
+public:
+    AABB box;
+    int entries = 0;
+    int exits = 0;
+};
+
+static inline bool isEmpty(const AABB &box)
+{
+    return !glm::all(glm::lessThanEqual(box.lo, box.hi));
+}
+
+// cost of the primitives on one side of a split, without the node area
+static inline float sideCost(const AABB &box, int count)
+{
+    return count > 0 ? box.area() * leafCost(count) : 0.0f;
+}
+
+// state of a spatial split build (SBVH, Stich et al. 2009). every node
+// takes the cheaper of the best binned object split, as in BinnedBuild,
+// and the best split of its bounds at one of the 31 bin planes per axis,
+// where references crossing the plane are clipped and go to both sides.
+// spatial splits are only tried where the object split children overlap,
+// and stop once the budget of extra references is used up. leaves are
+// written to indices as they are made, so the nodes are in depth first order
+class SpatialBuild
+{
+public:
+    const Mesh &mesh;
+    const std::vector<AABB> &boxes;
+    std::vector<int> &indices;
+    std::vector<BVHNode> &nodes;
+    float root_area = 0.0f;
+    long budget = 0; // references left to add
+    int num_spatial_splits = 0;
+
+    SpatialBuild(const Mesh &mesh, const std::vector<AABB> &boxes, std::vector<int> &indices, std::vector<BVHNode> &nodes)
+        : mesh(mesh), boxes(boxes), indices(indices), nodes(nodes) {}
+
+    void subdivide(int node_index, std::vector<Reference> &references, int depth);
+
+private:
+    void split(const Reference &reference, int axis, float position, Reference &left, Reference &right) const;
+    void leaf(int node_index, const std::vector<Reference> &references);
+};
+
+// the parts of reference below and above position along axis. triangles
+// are clipped exactly, then padded like their boxes. other primitives
+// keep the part of their box on either side. a part is empty (lo > hi)
+// if nothing of the primitive is on its side
+void SpatialBuild::split(const Reference &reference, int axis, float position, Reference &left, Reference &right) const
+{
+    left.primitive = right.primitive = reference.primitive;
+    left.box = right.box = AABB();
+    if (reference.primitive < (int)mesh.size())
+    {
+        const uint32_t *v = &mesh.indices[3 * reference.primitive];
+        for (int i = 0; i < 3; i++)
+        {
+            const glm::vec3 &A = mesh.positions[v[i]];
+            const glm::vec3 &B = mesh.positions[v[(i + 1) % 3]];
+            if (A[axis] <= position)
+                left.box.grow(A);
+            if (A[axis] >= position)
+                right.box.grow(A);
+            if ((A[axis] < position && B[axis] > position) || (A[axis] > position && B[axis] < position))
+            {
+                glm::vec3 P = glm::mix(A, B, (position - A[axis]) / (B[axis] - A[axis]));
+                P[axis] = position;
+                left.box.grow(P);
+                right.box.grow(P);
+            }
+        }
+        float pad = padding(mesh.bounds(reference.primitive));
+        for (Reference *part : {&left, &right})
+        {
+            if (isEmpty(part->box))
+                continue;
+            part->box.lo = glm::max(part->box.lo - glm::vec3(pad), reference.box.lo);
+            part->box.hi = glm::min(part->box.hi + glm::vec3(pad), reference.box.hi);
+            if (isEmpty(part->box))
+                part->box = AABB(); // the clipped part lies outside of this reference
+        }
+    }
+    else
+    {
+        left.box = right.box = reference.box;
+        left.box.hi[axis] = std::min(reference.box.hi[axis], position);
+        right.box.lo[axis] = std::max(reference.box.lo[axis], position);
+    }
+}
+
+void SpatialBuild::leaf(int node_index, const std::vector<Reference> &references)
+{
+    makeLeaf(nodes[node_index], indices.size(), indices.size() + references.size());
+    for (const Reference &reference : references)
+        indices.push_back(reference.primitive);
+}
+
+// build the subtree for references into nodes[node_index]. references is
+// emptied
+void SpatialBuild::subdivide(int node_index, std::vector<Reference> &references, int depth)
+{
+    AABB bounds, centroid_bounds;
+    for (const Reference &reference : references)
+    {
+        bounds.grow(reference.box);
+        centroid_bounds.grow(reference.box.centroid());
+    }
+    nodes[node_index].bounds = bounds;
+
+    int count = references.size();
+    if (count == 1 || depth >= max_depth)
+    {
+        leaf(node_index, references);
+        references.clear();
+        return;
+    }
+
+    // the best object split over the centroid bins
+    Bin bins[3][num_bins];
+    glm::vec3 scale(binScale(centroid_bounds, 0), binScale(centroid_bounds, 1), binScale(centroid_bounds, 2));
+    for (const Reference &reference : references)
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (scale[axis] == 0.0f)
+                continue;
+            Bin &bin = bins[axis][binOf(reference.box.centroid()[axis], centroid_bounds.lo[axis], scale[axis])];
+            bin.box.grow(reference.box);
+            bin.count++;
+        }
+
+    float best_cost = std::numeric_limits<float>::max();
+    int best_axis = -1;
+    int best_bin = 0;
+    AABB best_left, best_right;
+    float inv_area = 1.0f / bounds.area();
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (scale[axis] == 0.0f)
+            continue;
+
+        Bin right[num_bins];
+        for (int b = num_bins - 1; b > 0; b--)
+        {
+            right[b] = b + 1 < num_bins ? right[b + 1] : Bin();
+            right[b].grow(bins[axis][b]);
+        }
+
+        Bin left;
+        for (int b = 1; b < num_bins; b++)
+        {
+            left.grow(bins[axis][b - 1]);
+            if (left.count == 0 || right[b].count == 0)
+                continue;
+            float cost = traversal_cost + (sideCost(left.box, left.count) + sideCost(right[b].box, right[b].count)) * inv_area;
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+                best_left = left.box;
+                best_right = right[b].box;
+            }
+        }
+    }
+
+    // the best spatial split, if the object split children overlap enough to be worth it
+    int spatial_axis = -1;
+    float spatial_position = 0.0f;
+    AABB overlap;
+    overlap.lo = glm::max(best_left.lo, best_right.lo);
+    overlap.hi = glm::min(best_left.hi, best_right.hi);
+    bool overlapping = best_axis < 0 || (!isEmpty(overlap) && overlap.area() > min_split_overlap * root_area);
+    if (overlapping && budget > 0)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float lo = bounds.lo[axis], extent = bounds.hi[axis] - bounds.lo[axis];
+            if (!(extent > 0.0f))
+                continue;
+            float bin_scale = num_bins / extent;
+
+            // clip every reference into the bins it crosses
+            SpatialBin spatial_bins[num_bins];
+            for (const Reference &reference : references)
+            {
+                int first = binOf(reference.box.lo[axis], lo, bin_scale);
+                int last = binOf(reference.box.hi[axis], lo, bin_scale);
+                Reference rest = reference;
+                for (int b = first; b < last; b++)
+                {
+                    Reference part, crossing = rest;
+                    split(crossing, axis, lo + extent * (b + 1) / num_bins, part, rest);
+                    spatial_bins[b].box.grow(part.box);
+                }
+                spatial_bins[last].box.grow(rest.box);
+                spatial_bins[first].entries++;
+                spatial_bins[last].exits++;
+            }
+
+            float right_area[num_bins];
+            int right_count[num_bins];
+            AABB right;
+            int exits = 0;
+            for (int b = num_bins - 1; b > 0; b--)
+            {
+                right.grow(spatial_bins[b].box);
+                exits += spatial_bins[b].exits;
+                right_area[b] = sideCost(right, exits);
+                right_count[b] = exits;
+            }
+
+            AABB left;
+            int entries = 0;
+            for (int b = 1; b < num_bins; b++)
+            {
+                left.grow(spatial_bins[b - 1].box);
+                entries += spatial_bins[b - 1].entries;
+                // both sides may keep every reference, in smaller boxes
+                if (entries == 0 || right_count[b] == 0 || entries + right_count[b] - count > budget)
+                    continue;
+                float cost = traversal_cost + (sideCost(left, entries) + right_area[b]) * inv_area;
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    spatial_axis = axis;
+                    spatial_position = lo + extent * b / num_bins;
+                }
+            }
+        }
+    }
+
+    if (count <= max_leaf_size && ((best_axis < 0 && spatial_axis < 0) || best_cost >= leafCost(count)))
+    {
+        leaf(node_index, references);
+        references.clear();
+        return;
+    }
+
+    std::vector<Reference> left, right;
+    if (spatial_axis >= 0)
+    {
+        // references on one side go there, the others go to both sides
+        // unless one side alone is cheaper
+        int axis = spatial_axis;
+        std::vector<Reference> crossing;
+        AABB left_box, right_box;
+        for (const Reference &reference : references)
+        {
+            if (reference.box.hi[axis] <= spatial_position)
+            {
+                left.push_back(reference);
+                left_box.grow(reference.box);
+            }
+            else if (reference.box.lo[axis] >= spatial_position)
+            {
+                right.push_back(reference);
+                right_box.grow(reference.box);
+            }
+            else
+                crossing.push_back(reference);
+        }
+        for (const Reference &reference : crossing)
+        {
+            Reference left_part, right_part;
+            split(reference, axis, spatial_position, left_part, right_part);
+            bool left_empty = isEmpty(left_part.box);
+            bool right_empty = isEmpty(right_part.box);
+
+            int left_count = left.size(), right_count = right.size();
+            AABB both_left = left_box, both_right = right_box, all_left = left_box, all_right = right_box;
+            both_left.grow(left_part.box);
+            both_right.grow(right_part.box);
+            all_left.grow(reference.box);
+            all_right.grow(reference.box);
+            float both = sideCost(both_left, left_count + 1) + sideCost(both_right, right_count + 1);
+            float only_left = sideCost(all_left, left_count + 1) + sideCost(right_box, right_count);
+            float only_right = sideCost(left_box, left_count) + sideCost(all_right, right_count + 1);
+
+            if (right_empty || (!left_empty && only_left <= both && only_left <= only_right))
+            {
+                left.push_back(reference);
+                left_box = all_left;
+            }
+            else if (left_empty || only_right <= both)
+            {
+                right.push_back(reference);
+                right_box = all_right;
+            }
+            else
+            {
+                left.push_back(left_part);
+                right.push_back(right_part);
+                left_box = both_left;
+                right_box = both_right;
+            }
+        }
+        if (left.empty() || right.empty())
+        {
+            // every reference ended up on one side, split the objects instead
+            left.clear();
+            right.clear();
+        }
+        else
+        {
+            budget -= (long)(left.size() + right.size()) - count;
+            num_spatial_splits++;
+        }
+    }
+    if (left.empty() && best_axis >= 0)
+    {
+        float lo = centroid_bounds.lo[best_axis];
+        for (const Reference &reference : references)
+            (binOf(reference.box.centroid()[best_axis], lo, scale[best_axis]) < best_bin ? left : right).push_back(reference);
+    }
+    else if (left.empty())
+    {
+        // centroids too close to bin, split in the middle
+        left.assign(references.begin(), references.begin() + count / 2);
+        right.assign(references.begin() + count / 2, references.end());
+    }
+    references.clear();
+    references.shrink_to_fit();
+
+    int first = nodes.size();
+    nodes.push_back(BVHNode());
+    nodes.push_back(BVHNode());
+    nodes[node_index].first = first;
+    nodes[node_index].count = 0;
+    nodes[node_index].blocks = 0;
+
+    subdivide(first, left, depth + 1);
+    subdivide(first + 1, right, depth + 1);
+}
+
+void BVH::buildSpatial(const Mesh &mesh, float split_budget)
+{
+    int n = boxes.size();
+    std::vector<Reference> references(n);
+    AABB root;
+    for (int i = 0; i < n; i++)
+    {
+        references[i].box = boxes[i];
+        references[i].primitive = i;
+        root.grow(boxes[i]);
+    }
+
+    indices.clear();
+    tree.reserve(2 * n);
+    tree.push_back(BVHNode());
+    SpatialBuild build(mesh, boxes, indices, tree);
+    build.root_area = root.area();
+    build.budget = (long)(std::max(split_budget, 0.0f) * n);
+    build.subdivide(0, references, 0);
+    spatial_splits = build.num_spatial_splits;
+}
+
+// put the nodes in depth first order: the two children of a node next to
+// each other, each subtree behind them. this is the order subdivide
+// creates, and it makes the binned layout independent of thread timing
+void BVH::reorder()
+{
+    std::vector<BVHNode> ordered;
+    ordered.reserve(tree.size());
+    ordered.push_back(tree[0]);
+
+    // pairs of (old index, new index)
+    std::vector<std::pair<int, int>> stack;
+    stack.push_back(std::make_pair(0, 0));
+    while (!stack.empty())
+    {
+        std::pair<int, int> entry = stack.back();
+        stack.pop_back();
+        const BVHNode &node = tree[entry.first];
+        if (node.isLeaf())
+            continue;
+
+        int first = ordered.size();
+        ordered.push_back(tree[node.first]);
+        ordered.push_back(tree[node.first + 1]);
+        ordered[entry.second].first = first;
+        stack.push_back(std::make_pair(node.first + 1, first + 1));
+        stack.push_back(std::make_pair(node.first, first));
+    }
+    tree.swap(ordered);
+}
+
+// move the triangles of every leaf into blocks of 8, so a leaf is tested
+// with one 8-wide kernel call per block instead of one call per triangle.
+// the spheres and instances of a leaf stay first in its range of indices
+void BVH::packBlocks(const Mesh &mesh)
+{
+    for (BVHNode &node : tree)
+    {
+        if (!node.isLeaf())
+            continue;
+
+        auto begin = indices.begin() + node.first;
+        auto end = begin + node.count;
+        auto first_triangle = std::stable_partition(begin, end, [&](int p) { return !isTriangle(p); });
+
+        node.block = blocks.size();
+        node.blocks = 0;
+        for (auto it = first_triangle; it != end; it++)
+        {
+            int lane = (it - first_triangle) % TriBlock::width;
+            if (lane == 0)
+            {
+                blocks.push_back(TriBlock());
+                node.blocks++;
+            }
+            blocks.back().set(lane, mesh.triangle(*it), *it);
+        }
+        node.count = first_triangle - begin;
+    }
+}
+
+// the SAH cost of a lane with bounds box, before dividing by the root area
+static float laneCost(const AABB &box, int child, const std::vector<BVHLeaf> &leaves)
+{
+    if (child > 0)
+        return box.area() * traversal_cost;
+    const BVHLeaf &leaf = leaves[~child];
+    return box.area() * (leaf.blocks + leafCost(leaf.count));
+}
+
+// the children of every node, bounded as the traversal sees them
+template <class Node>
+static float wideCost(const std::vector<Node> &nodes, const std::vector<BVHLeaf> &leaves)
+{
+    float total = 0.0f;
+    AABB root;
+    for (const Node &node : nodes)
+        for (int i = 0; i < Node::width; i++)
+        {
+            if (node.child[i] == 0)
+                continue;
+            total += laneCost(node.bounds(i), node.child[i], leaves);
+            if (&node == &nodes[0])
+                root.grow(node.bounds(i));
+        }
+    return total / root.area() + traversal_cost;
+}
+
+const int *BVH::children(int node) const
+{
+    return quantized_nodes.empty() ? nodes[node].child : quantized_nodes[node].child;
+}
+
+// the bounds of a leaf's primitives, padded like in the build. leaves of
+// spatial splits get the whole primitives, not the parts they were built with
+AABB BVH::leafBounds(int leaf, const Mesh &mesh, const std::vector<Sphere> &spheres,
+                     const std::vector<Instance> &instances) const
+{
+    const BVHLeaf &l = leaves[leaf];
+    AABB box;
+    for (int i = l.first; i < l.first + l.count; i++)
+        box.grow(primitiveBounds(indices[i], mesh, spheres, instances));
+    for (int b = l.block; b < l.block + l.blocks; b++)
+        for (int lane = 0; lane < TriBlock::width; lane++)
+            if (blocks[b].index[lane] >= 0)
+                box.grow(primitiveBounds(blocks[b].index[lane], mesh, spheres, instances));
+    return box;
+}
+
+// set the lanes of a node from the bounds of its children
+template <class Node>
+static void setLanes(Node &node, const AABB &bounds, const std::vector<AABB> &node_bounds,
+                     const std::vector<AABB> &leaf_bounds)
+{
+    node.setBounds(bounds);
+    for (int lane = 0; lane < Node::width; lane++)
+    {
+        int child = node.child[lane];
+        if (child != 0)
+            node.set(lane, child > 0 ? node_bounds[child] : leaf_bounds[~child], child);
+    }
+}
+
+void BVH::prepareRefit(const Mesh &mesh, const std::vector<Sphere> &spheres, const std::vector<Instance> &instances)
+{
+    RefitState &state = refit_state;
+    int num_nodes = std::max(nodes.size(), quantized_nodes.size());
+    int num_primitives = mesh.size() + spheres.size() + instances.size();
+
+    state.node_parents.assign(num_nodes, -1);
+    state.leaf_parents.assign(leaves.size(), -1);
+    for (int node = 0; node < num_nodes; node++)
+        for (int lane = 0; lane < WideNode::width; lane++)
+        {
+            int child = children(node)[lane];
+            if (child > 0)
+                state.node_parents[child] = node * WideNode::width + lane;
+            else if (child < 0)
+                state.leaf_parents[~child] = node * WideNode::width + lane;
+        }
+
+    // the leaves of every primitive, counted and then filled in
+    auto forEachPrimitive = [&](int leaf, auto fn) {
+        const BVHLeaf &l = leaves[leaf];
+        for (int i = l.first; i < l.first + l.count; i++)
+            fn(indices[i]);
+        for (int b = l.block; b < l.block + l.blocks; b++)
+            for (int lane = 0; lane < TriBlock::width; lane++)
+                if (blocks[b].index[lane] >= 0)
+                    fn(blocks[b].index[lane]);
+    };
+    state.leaf_start.assign(num_primitives + 1, 0);
+    for (int leaf = 0; leaf < (int)leaves.size(); leaf++)
+        forEachPrimitive(leaf, [&](int p) { state.leaf_start[p + 1]++; });
+    for (int p = 0; p < num_primitives; p++)
+        state.leaf_start[p + 1] += state.leaf_start[p];
+    state.primitive_leaves.resize(state.leaf_start[num_primitives]);
+    std::vector<int> filled(state.leaf_start.begin(), state.leaf_start.end() - 1);
+    for (int leaf = 0; leaf < (int)leaves.size(); leaf++)
+        forEachPrimitive(leaf, [&](int p) { state.primitive_leaves[filled[p]++] = leaf; });
+
+    // exact bounds bottom up: children come after their parents
+    state.leaf_bounds.resize(leaves.size());
+    for (int leaf = 0; leaf < (int)leaves.size(); leaf++)
+        state.leaf_bounds[leaf] = leafBounds(leaf, mesh, spheres, instances);
+    state.node_bounds.assign(num_nodes, AABB());
+    state.lane_cost = 0.0;
+    for (int node = num_nodes - 1; node >= 0; node--)
+        for (int lane = 0; lane < WideNode::width; lane++)
+        {
+            int child = children(node)[lane];
+            if (child == 0)
+                continue;
+            const AABB &box = child > 0 ? state.node_bounds[child] : state.leaf_bounds[~child];
+            state.node_bounds[node].grow(box);
+            state.lane_cost += laneCost(box, child, leaves);
+        }
+
+    // the primitives may have moved since the lanes were set
+    for (int node = 0; node < num_nodes; node++)
+        if (quantized_nodes.empty())
+            setLanes(nodes[node], state.node_bounds[node], state.node_bounds, state.leaf_bounds);
+        else
+            setLanes(quantized_nodes[node], state.node_bounds[node], state.node_bounds, state.leaf_bounds);
+    state.node_dirty.assign(num_nodes, 0);
+    state.leaf_dirty.assign(leaves.size(), 0);
+
+    // the cost to compare against is that of the rewritten lanes, not
+    // cost() of the built ones: spatial splits clip the leaf boxes of an
+    // sbvh tree, and whole primitives bound them from here on, so the
+    // built cost would be exceeded with nothing moved
+    state.initial_cost = state.lane_cost / state.node_bounds[0].area() + traversal_cost;
+}
+
+float BVH::refit(const Mesh &mesh, const std::vector<Sphere> &spheres, const std::vector<Instance> &instances,
+                 const std::vector<int> &moved)
+{
+    if (empty())
+        return 1.0f;
+    RefitState &state = refit_state;
+    if (state.node_parents.empty())
+        prepareRefit(mesh, spheres, instances);
+
+    // the leaves of the moved primitives, with the moved triangles updated in their blocks
+    std::vector<int> dirty_leaves;
+    for (int p : moved)
+        for (int i = state.leaf_start[p]; i < state.leaf_start[p + 1]; i++)
+        {
+            int leaf = state.primitive_leaves[i];
+            if (isTriangle(p))
+            {
+                const BVHLeaf &l = leaves[leaf];
+                for (int b = l.block; b < l.block + l.blocks; b++)
+                    for (int lane = 0; lane < TriBlock::width; lane++)
+                        if (blocks[b].index[lane] == p)
+                            blocks[b].set(lane, mesh.triangle(p), p);
+            }
+            if (!state.leaf_dirty[leaf])
+            {
+                state.leaf_dirty[leaf] = 1;
+                dirty_leaves.push_back(leaf);
+            }
+        }
+
+    // new leaf bounds, then the nodes above them deepest first. a node is
+    // visited after all of its changed children, since they come after it
+    std::priority_queue<int> dirty_nodes;
+    auto markParent = [&](int parent_lane) {
+        int parent = parent_lane / WideNode::width;
+        if (!state.node_dirty[parent])
+        {
+            state.node_dirty[parent] = 1;
+            dirty_nodes.push(parent);
+        }
+    };
+    for (int leaf : dirty_leaves)
+    {
+        state.leaf_dirty[leaf] = 0;
+        AABB box = leafBounds(leaf, mesh, spheres, instances);
+        state.lane_cost += laneCost(box, ~leaf, leaves) - laneCost(state.leaf_bounds[leaf], ~leaf, leaves);
+        state.leaf_bounds[leaf] = box;
+        markParent(state.leaf_parents[leaf]);
+    }
+    while (!dirty_nodes.empty())
+    {
+        int node = dirty_nodes.top();
+        dirty_nodes.pop();
+        state.node_dirty[node] = 0;
+
+        AABB box;
+        for (int lane = 0; lane < WideNode::width; lane++)
+        {
+            int child = children(node)[lane];
+            if (child != 0)
+                box.grow(child > 0 ? state.node_bounds[child] : state.leaf_bounds[~child]);
+        }
+        bool changed = box.lo != state.node_bounds[node].lo || box.hi != state.node_bounds[node].hi;
+        if (node > 0 && changed)
+            state.lane_cost += laneCost(box, node, leaves) - laneCost(state.node_bounds[node], node, leaves);
+        state.node_bounds[node] = box;
+        if (quantized_nodes.empty())
+            setLanes(nodes[node], box, state.node_bounds, state.leaf_bounds);
+        else
+            setLanes(quantized_nodes[node], box, state.node_bounds, state.leaf_bounds);
+        if (node > 0 && changed)
+            markParent(state.node_parents[node]);
+    }
+
+    float cost = state.lane_cost / state.node_bounds[0].area() + traversal_cost;
+    return cost / state.initial_cost;
+}
+
+float BVH::cost() const
+{
+    if (empty())
+        return 0.0f;
+    return quantized_nodes.empty() ? wideCost(nodes, leaves) : wideCost(quantized_nodes, leaves);
+}
+
+AABB BVH::bounds() const
+{
+    AABB box;
+    for (int i = 0; i < WideNode::width; i++)
+    {
+        if (!nodes.empty() && nodes[0].child[i] != 0)
+            box.grow(nodes[0].bounds(i));
+        if (!quantized_nodes.empty() && quantized_nodes[0].child[i] != 0)
+            box.grow(quantized_nodes[0].bounds(i));
+    }
+    return box;
+}
+
+size_t BVH::nodeMemory() const
+{
+    return nodes.size() * sizeof(WideNode) + quantized_nodes.size() * sizeof(QuantizedNode) +
+           leaves.size() * sizeof(BVHLeaf);
+}
+
+const char *BVH::methodName(Method method)
+{
+    switch (method)
+    {
+    case sweep:
+        return "sweep";
+    case binned:
+        return "binned";
+    case lbvh:
+        return "lbvh";
+    default:
+        return "sbvh";
+    }
+}
+
+bool BVH::parseMethod(const std::string &name, Method &method)
+{
+    for (Method m : {sweep, binned, lbvh, sbvh})
+        if (name == methodName(m))
+        {
+            method = m;
+            return true;
+        }
+    return false;
+}
@@ -0,0 +1,144 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <string>
+#include <vector>
+
+#include "geometry.h"
+#include "triblock.h"
+#include "widenode.h"
+
+//node of the binary tree the builders make, before it is collapsed into
+//wide nodes. interior nodes store their two children next to each other
+//starting at tree[first]. leaves hold their triangles in blocks TriBlocks
+//starting at BVH::blocks[block], and their spheres and instances in count
+//entries of BVH::indices starting at first
+class BVHNode {
+	public:
+		AABB bounds;
+		int first;
+		int count; //number of spheres and instances
+		int block;
+		int blocks; //number of triangle blocks, 0 with count for interior nodes
+
+		bool isLeaf() const { return count > 0 || blocks > 0; }
+};
+
+//leaf of the BVH, as a leaf BVHNode without the bounds, which are stored
+//in its parent
+class BVHLeaf {
+	public:
+		int first;
+		int count;
+		int block;
+		int blocks;
+};
+
+//bounding volume hierarchy over the scene primitives, split with the
+//surface area heuristic (SAH). built once after the scene is read.
+//primitives are numbered triangles first, then spheres, then instances:
+//primitive p is triangle p of the mesh if p < num_triangles, else
+//spheres[p - num_triangles] if p < num_triangles + num_spheres, else
+//instances[p - num_triangles - num_spheres].
+//on equal distance the lower number wins, which keeps hits deterministic.
+//the scene has one BVH over its world space primitives and instances (the
+//top level), and one per shape over the shape's primitives (bottom level).
+//it is built as a binary tree and stored with up to 8 children per node,
+//which rays test in one SIMD kernel call (see widenode.h)
+class BVH {
+	public:
+		std::vector<WideNode> nodes; //nodes[0] is the root, empty if quantized or there are no primitives
+		std::vector<QuantizedNode> quantized_nodes; //used instead of nodes if quantized
+		std::vector<BVHLeaf> leaves;
+		std::vector<int> indices; //primitive numbers in leaf order, some in several leaves after spatial splits
+		std::vector<TriBlock> blocks; //leaf triangles, 8 to a block
+		int num_triangles = 0;
+		int num_spheres = 0;
+		int spatial_splits = 0; //made by the last sbvh build, for the build stats
+
+		//how the binary tree is built. all give the same images
+		enum Method {
+			sweep, //exact SAH sweep over sorted primitives, one thread
+			binned, //SAH over 32 bins per axis, top levels split across threads
+			lbvh, //primitives sorted along a Morton curve, near linear time but slower to trace
+			sbvh, //binned SAH that may also split primitives between nodes at a plane (spatial
+				  //splits), for long thin triangles whose boxes overlap. one thread
+		};
+
+		//how the hierarchy is built and stored. all give the same images
+		class Options {
+			public:
+				Method method = binned;
+				int width = WideNode::width; //children per node, 2 to 8
+				bool quantize = false; //8-bit child bounds, for less than half the node memory
+				float split_budget = 0.3f; //sbvh: extra primitive references that spatial splits may add, per primitive
+				float max_refit_cost = 1.2f; //rebuild instead of refitting once the SAH cost grows past this times the cost at the first refit
+		};
+
+		//num_threads 0 uses every hardware thread. the result does not
+		//depend on the number of threads. instances need their bounds set
+		void build(const Mesh& mesh, const std::vector<Sphere>& spheres, const std::vector<Instance>& instances,
+				   const Options& options, int num_threads = 0);
+
+		//update the bounds above the primitives in moved (primitive numbers)
+		//after they moved, keeping the tree, and the moved triangles in
+		//their blocks. the first call after a build makes tables from the
+		//primitives to the leaves and parents, later calls only visit the
+		//leaves of moved primitives and the nodes above them. returns the
+		//SAH cost relative to the tree as the first refit found it, its
+		//lanes bounding whole primitives, which grows as the tree fits the
+		//primitives worse
+		float refit(const Mesh& mesh, const std::vector<Sphere>& spheres, const std::vector<Instance>& instances,
+					const std::vector<int>& moved);
+
+		bool empty() const { return nodes.empty() && quantized_nodes.empty(); }
+		bool isTriangle(int primitive) const { return primitive < num_triangles; }
+		bool isSphere(int primitive) const { return primitive >= num_triangles && primitive < num_triangles + num_spheres; }
+
+		//bounds of all primitives
+		AABB bounds() const;
+
+		//expected cost of a ray, in units of one block test, for comparing builds
+		float cost() const;
+
+		//bytes of the nodes and leaves
+		size_t nodeMemory() const;
+
+		static const char* methodName(Method method);
+		static bool parseMethod(const std::string& name, Method& method);
+
+	private:
+		//what refit keeps between calls. child bounds are kept exact, for
+		//requantizing quantized nodes
+		class RefitState {
+			public:
+				std::vector<int> node_parents; //node * WideNode::width + lane of every node's parent lane, -1 for the root
+				std::vector<int> leaf_parents;
+				std::vector<int> leaf_start; //the leaves of primitive p are primitive_leaves[leaf_start[p]] up to leaf_start[p + 1]
+				std::vector<int> primitive_leaves;
+				std::vector<AABB> node_bounds;
+				std::vector<AABB> leaf_bounds;
+				std::vector<char> node_dirty;
+				std::vector<char> leaf_dirty;
+				double lane_cost = 0.0; //area times cost of every lane, the SAH cost before dividing by the root area
+				float initial_cost = 0.0f; //SAH cost of the lanes when the refit was prepared
+		};
+		RefitState refit_state;
+
+		std::vector<BVHNode> tree; //the binary tree, only valid during build
+		std::vector<AABB> boxes; //per primitive bounds, only valid during build
+		std::vector<glm::vec3> centroids;
+
+		void subdivide(int node_index, int begin, int end, int depth);
+		void buildBinned(int num_threads);
+		void buildLBVH(int num_threads);
+		void buildSpatial(const Mesh& mesh, float split_budget);
+		void reorder();
+		void packBlocks(const Mesh& mesh);
+		void prepareRefit(const Mesh& mesh, const std::vector<Sphere>& spheres, const std::vector<Instance>& instances);
+		AABB leafBounds(int leaf, const Mesh& mesh, const std::vector<Sphere>& spheres,
+						const std::vector<Instance>& instances) const;
+		const int* children(int node) const;
+};
+
+#endif
@@ -1,18 +1,40 @@
 #include "geometry.h"
 
-const float epsilon = 1e-4;
-
 // helpers to solve quadratic equations
 float computeDiscr(const Ray &ray, const glm::vec3 &center, const float &radius);
 std::pair<float, float> solveRoots(const Ray &ray, const glm::vec3 &center, float discr);
 
-// the following empty definitions are for compilation
-bool Object::hit(const Ray &ray, float &t_val) { return false; }
-glm::vec3 Object::interpolate(const glm::vec3& P) { return glm::vec3(); }
+Ray transform(const Ray &ray, const glm::mat4 &M)
+{
+    glm::vec4 trans_origin = M * glm::vec4(ray.origin, 1.0f);
+    glm::vec4 trans_direction = M * glm::vec4(ray.direction, 0.0f);
+
+    return Ray(glm::vec3(trans_origin) / trans_origin.w, glm::vec3(trans_direction));
+}
+
+bool Sphere::flatten(const glm::mat4 &M)
+{
+    // a similarity has orthogonal columns of equal length
+    glm::mat3 A(M);
+    float scale2 = glm::dot(A[0], A[0]);
+    float tol = 1e-5f * scale2;
+    bool similarity = glm::abs(glm::dot(A[1], A[1]) - scale2) <= tol &&
+                      glm::abs(glm::dot(A[2], A[2]) - scale2) <= tol &&
+                      glm::abs(glm::dot(A[0], A[1])) <= tol &&
+                      glm::abs(glm::dot(A[1], A[2])) <= tol &&
+                      glm::abs(glm::dot(A[2], A[0])) <= tol;
+    if (!similarity)
+        return false;
+
+    glm::vec4 C4 = M * glm::vec4(center, 1.0f);
+    center = glm::vec3(C4) / C4.w;
+    radius *= glm::sqrt(scale2);
+    return true;
+}
 
-// return true if sphere was hit, false otherwise
+// return true if sphere was hit in front of t_min, false otherwise
 // record hit parameter t_val (for equation ray = origin + direction * t_val)
-bool Sphere::hit(const Ray &ray, float &t_val)
+bool Sphere::hit(const Ray &ray, float t_min, float &t_val) const
 {
     float discr = computeDiscr(ray, center, radius);
     if (discr < 0.0f) // no intersection
@@ -22,115 +44,160 @@ bool Sphere::hit(const Ray &ray, float &t_val)
     std::pair<float, float> roots;
     roots = solveRoots(ray, center, discr);
 
-    if (roots.first >= 0 && roots.second >= 0)       // if there're 2 intersections
-        t_val = std::min(roots.first, roots.second); // or a tangent
+    float near = std::min(roots.first, roots.second);
+    float far = std::max(roots.first, roots.second);
+
+    if (near > t_min) // both intersections in front, or a tangent
+        t_val = near;
+    else if (far > t_min) // ray starts inside the sphere
+        t_val = far;
     else
-        t_val = std::max(roots.first, roots.second); // 1 root is negative
+        return false;
 
     return true;
 }
 
 //return interpolated normal
-glm::vec3 Sphere::interpolate(const glm::vec3& P) {
-    glm::vec4 P4 = glm::vec4(P, 1.0f);
-    P4 = inv_trans * P4;
-    // P4 = glm::transpose(inv_trans) * P4;
-    glm::vec3 ret = glm::vec3(P4) / P4.w;
-
-    P4 = glm::vec4(ret - center, 0.0f);
-    P4 = glm::transpose(inv_trans) * P4;
-    // P4 = inv_trans * P4;
-
-    ret = glm::vec3(P4);
-    return glm::normalize(ret);
+glm::vec3 Sphere::interpolate(const glm::vec3& P) const {
+    return glm::normalize(P - center);
+}
 
-    // glm::vec4 norm(P - center, 0.0f);
-    // norm = glm::inverse(glm::transpose(trans)) * norm;
-    // return glm::normalize(glm::vec3(norm));
+AABB Sphere::bounds() const
+{
+    AABB box;
+    box.grow(center - glm::vec3(radius));
+    box.grow(center + glm::vec3(radius));
+    return box;
 }
 
+Triangle::Triangle(const glm::vec3 &A, const glm::vec3 &B, const glm::vec3 &C)
+{
+    vertex = A;
+    edge1 = B - A;
+    edge2 = C - A;
+    normal = glm::cross(edge1, edge2);
+}
 
-// return true if triangle was hit, false otherwise
+// Moller-Trumbore test against the precomputed edges: no square roots,
+// and it leaves as soon as a barycentric coordinate is out of range.
+// return true if triangle was hit in front of t_min, false otherwise
 // record hit parameter t_val (for equation ray = origin + direction * t_val)
-bool Triangle::hit(const Ray &ray, float &t_val)
+// and the barycentric coordinates (beta, gamma) of B and C in bary
+bool Triangle::hit(const Ray &ray, float t_min, float &t_val, glm::vec2 &bary) const
 {
-    glm::vec3 A, B, C; // vertices of the triangle
-    A = vertices[0];
-    B = vertices[1];
-    C = vertices[2];
+    glm::vec3 pvec = glm::cross(ray.direction, edge2);
+    float det = glm::dot(edge1, pvec); // -dot(direction, normal)
 
-    glm::vec3 norm = glm::cross(B - A, C - A);
-    float dir_dot_norm = glm::dot(ray.direction, norm);
-
-    if (glm::abs(dir_dot_norm) < epsilon) // close to zero, no intersection
+    if (glm::abs(det) < epsilon) // close to parallel, no intersection
         return false;
 
-    float tmp_t_val;
-    tmp_t_val = glm::dot(A, norm) - glm::dot(ray.origin, norm);
-    tmp_t_val /= glm::dot(ray.direction, norm);
+    float inv_det = 1.0f / det;
+    glm::vec3 tvec = ray.origin - vertex;
 
-    glm::vec3 P = ray.origin + ray.direction * tmp_t_val;
+    float beta = glm::dot(tvec, pvec) * inv_det;
+    if (beta < -epsilon || beta > 1.0f + epsilon)
+        return false;
 
-    glm::vec3 area(0.0f, 0.0f, 0.0f);
-    float area_val = 0.0f;
+    glm::vec3 qvec = glm::cross(tvec, edge1);
+    float gamma = glm::dot(ray.direction, qvec) * inv_det;
+    float alpha = 1.0f - beta - gamma;
+    if (gamma < -epsilon || gamma > 1.0f + epsilon ||
+        alpha < -epsilon || alpha > 1.0f + epsilon)
+        return false;
 
-    glm::vec3 tmp_cross = glm::cross(P - A, P - B);
-    area_val += glm::length(tmp_cross);
-    area += tmp_cross;
+    float tmp_t_val = glm::dot(edge2, qvec) * inv_det;
+    if (tmp_t_val <= t_min) // behind the ray origin
+        return false;
 
-    tmp_cross = glm::cross(P - B, P - C);
-    area_val += glm::length(tmp_cross);
-    area += tmp_cross;
+    t_val = tmp_t_val;
+    bary = glm::vec2(beta, gamma);
+    return true;
+}
 
-    tmp_cross = glm::cross(P - C, P - A);
-    area_val += glm::length(tmp_cross);
-    area += tmp_cross;
+AABB Triangle::bounds() const
+{
+    AABB box;
+    box.grow(vertex);
+    box.grow(vertex + edge1);
+    box.grow(vertex + edge2);
+    return box;
+}
 
-    glm::vec3 cross1 = glm::cross(C - P, A - P);
-    glm::vec3 cross2 = glm::cross(A - P, B - P);
+uint32_t Mesh::addVertex(const glm::vec3 &P)
+{
+    positions.push_back(P);
+    if (!normals.empty())
+        normals.push_back(glm::vec3(0.0f));
+    return positions.size() - 1;
+}
 
-    float norm_dot_norm = glm::dot(norm, norm);
+uint32_t Mesh::addVertex(const glm::vec3 &P, const glm::vec3 &N)
+{
+    // normals are only stored once some vertex has one
+    normals.resize(positions.size(), glm::vec3(0.0f));
+    positions.push_back(P);
+    normals.push_back(N);
+    return positions.size() - 1;
+}
 
-    float alpha, beta, gamma;
+void Mesh::addTriangle(uint32_t a, uint32_t b, uint32_t c, int material)
+{
+    indices.push_back(a);
+    indices.push_back(b);
+    indices.push_back(c);
+    materials.push_back(material);
+}
 
-    beta = glm::dot(cross1, norm) / norm_dot_norm;
-    gamma = glm::dot(cross2, norm) / norm_dot_norm;
-    alpha = 1.0 - beta - gamma;
+Triangle Mesh::triangle(size_t t) const
+{
+    const uint32_t *v = &indices[3 * t];
+    Triangle tri(positions[v[0]], positions[v[1]], positions[v[2]]);
+    tri.material = materials[t];
+    return tri;
+}
 
-    float one_eps = 1.0f + epsilon;
-    if (beta > -epsilon && beta < one_eps &&
-        gamma > -epsilon && gamma < one_eps &&
-        alpha > -epsilon && alpha < one_eps) 
+glm::vec3 Mesh::normal(size_t t, const glm::vec2 &bary) const
+{
+    const uint32_t *v = &indices[3 * t];
+    if (!normals.empty() && normals[v[0]] != glm::vec3(0.0f))
     {
-        t_val = tmp_t_val;
-        return true;
-    } else
-        return false;
+        glm::vec3 N = (1.0f - bary.x - bary.y) * normals[v[0]] + bary.x * normals[v[1]] + bary.y * normals[v[2]];
+        if (glm::dot(N, N) > 0.0f)
+            return glm::normalize(N);
+    }
+    // flat shading with the geometric normal
+    return glm::normalize(glm::cross(positions[v[1]] - positions[v[0]], positions[v[2]] - positions[v[0]]));
 }
 
-glm::vec3 Triangle::interpolate(const glm::vec3& P) {
-    glm::vec3 A = vertices[0];
-    glm::vec3 B = vertices[1];
-    glm::vec3 C = vertices[2];  
-
-    glm::vec4 P_trans4 = inv_trans * glm::vec4(P, 1.0f);
-    glm::vec3 P_trans = glm::vec3(P_trans4) / P_trans4.w;
-    // glm::vec3 P_trans = P;
-
-    glm::vec3 norm = glm::cross(B-A, C-A);
-    glm::vec3 cross1 = glm::cross(C-P_trans, A-P_trans);
-    glm::vec3 cross2 = glm::cross(A-P_trans, B-P_trans);
-    
-    float norm_dot_norm = glm::dot(norm, norm);
-    float beta = glm::dot(norm, cross1) / norm_dot_norm;
-    float gamma = glm::dot(norm, cross2) / norm_dot_norm;
-    float alpha = 1.0f - beta - gamma;
-
-    glm::vec3 tmp = (norm * alpha) + (norm * beta) + (norm * gamma);
+AABB Mesh::bounds(size_t t) const
+{
+    const uint32_t *v = &indices[3 * t];
+    AABB box;
+    box.grow(positions[v[0]]);
+    box.grow(positions[v[1]]);
+    box.grow(positions[v[2]]);
+    return box;
+}
 
-    return glm::normalize(glm::vec3((glm::transpose(inv_trans) * glm::vec4(tmp, 0.0f))));
-    // return glm::normalize(glm::vec3(inv_trans * glm::vec4(tmp,0.0f)));
+// normals transform with the inverse transpose
+glm::vec3 Instance::normal(const glm::vec3 &N) const
+{
+    return glm::normalize(glm::vec3(glm::transpose(inv_trans) * glm::vec4(N, 0.0f)));
+}
 
+// the transformed corners of the box
+AABB Instance::transformBounds(const AABB &box) const
+{
+    AABB world;
+    for (int i = 0; i < 8; i++)
+    {
+        glm::vec3 corner(i & 1 ? box.hi.x : box.lo.x,
+                         i & 2 ? box.hi.y : box.lo.y,
+                         i & 4 ? box.hi.z : box.lo.z);
+        glm::vec4 P4 = trans * glm::vec4(corner, 1.0f);
+        world.grow(glm::vec3(P4) / P4.w);
+    }
+    return world;
 }
 
 float computeDiscr(const Ray &ray, const glm::vec3 &center, const float &radius)
@@ -1,3 +1,6 @@
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
 // Force glm to use radians since usage of degrees is deprecated
 #ifndef GLM_FORCE_RADIANS
 #define GLM_FORCE_RADIANS
@@ -7,6 +10,12 @@
 
 #include <FreeImage.h>
 
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+const float epsilon = 1e-4; //tolerance for hits and secondary ray offsets
+
 //ray class
 class Ray { //Ray equation is P0 + P1*t
 	public:
@@ -20,24 +29,76 @@ class Ray { //Ray equation is P0 + P1*t
 		Ray() {}
 };
 
-//general object class for derivation of triangles and sphere classes
-class Object{
+//axis aligned bounding box
+class AABB {
 	public:
-		glm::mat4 trans; //transformation matrix
-		glm::mat4 inv_trans; //inverse transformation matrix
+		glm::vec3 lo;
+		glm::vec3 hi;
+
+		//empty box, the first grow() sets it to a point
+		AABB() : lo(std::numeric_limits<float>::max()), hi(-std::numeric_limits<float>::max()) {}
+
+		void grow(const glm::vec3& p) {
+			lo = glm::min(lo, p);
+			hi = glm::max(hi, p);
+		}
+
+		void grow(const AABB& box) {
+			lo = glm::min(lo, box.lo);
+			hi = glm::max(hi, box.hi);
+		}
+
+		glm::vec3 centroid() const { return (lo + hi) * 0.5f; }
+
+		//surface area, used by the SAH
+		float area() const {
+			glm::vec3 d = hi - lo;
+			return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+		}
+
+		//intersect the line origin + direction * t with the box slabs.
+		//inv_dir is 1 / direction; t_near and t_far are not clamped to t >= 0
+		bool slabs(const glm::vec3& origin, const glm::vec3& inv_dir, float& t_near, float& t_far) const {
+			glm::vec3 t0 = (lo - origin) * inv_dir;
+			glm::vec3 t1 = (hi - origin) * inv_dir;
+			glm::vec3 t_min = glm::min(t0, t1);
+			glm::vec3 t_max = glm::max(t0, t1);
+			t_near = std::max(std::max(t_min.x, t_min.y), t_min.z);
+			t_far = std::min(std::min(t_max.x, t_max.y), t_max.z);
+			return t_near <= t_far;
+		}
+};
 
-		//material properties
+//transform a ray by a matrix, e.g. from world into object space
+Ray transform(const Ray& ray, const glm::mat4& M);
+
+//material properties. primitives refer to an entry of the scene's
+//material table, so identical materials are stored once
+class Material {
+	public:
 		glm::vec3 diffuse;
 		glm::vec3 specular;
 		glm::vec3 emission;
 		glm::vec3 ambient = glm::vec3(0.2f, 0.2f, 0.2f);
 		float shininess;
+};
 
-		enum {triangle, sphere} type;
+//common base of triangles and spheres. there are no virtual functions:
+//the scene keeps one array per primitive type and code dispatches on the
+//type once per array (or BVH leaf), not once per primitive.
+//objects are stored in world space, rays are passed in world space.
+//every type has
+//	bool hit(const Ray& ray, float t_min, float& t_val, ...) const
+//		nearest hit with t_val > t_min, in units of the ray direction
+//	AABB bounds() const
+//		world space bounds
+class Object{
+	public:
+		int material; //index into the material table
+
+		enum Type {triangle, sphere};
 
 		Object() {}
-		virtual bool hit(const Ray& ray, float& t_val);
-		virtual glm::vec3 interpolate(const glm::vec3& P);
 };
 
 class Sphere : public Object {
@@ -46,22 +107,76 @@ class Sphere : public Object {
 		float radius;
 
 		Sphere() {}
-		virtual bool hit(const Ray& ray, float& t_val) ;
-		virtual glm::vec3 interpolate(const glm::vec3& P);
 
+		//move the sphere into world space under transform M. only possible
+		//if M is a similarity (it keeps the sphere round); otherwise the
+		//sphere is left as it is and returns false, to be instanced
+		bool flatten(const glm::mat4& M);
+		bool hit(const Ray& ray, float t_min, float& t_val) const;
+		glm::vec3 interpolate(const glm::vec3& P) const; //normal at P
+		AABB bounds() const;
 };
 
 class Triangle : public Object {
 	public: 
-		glm::vec3 vertices[3];
-		bool areNorms; //indicates whether vertices have norms
-						//i.e. whether the next array is worth using
-		glm::vec3 vertexnorms[3];
+		//world space vertex A and the edges B-A and C-A
+		glm::vec3 vertex;
+		glm::vec3 edge1;
+		glm::vec3 edge2;
+		glm::vec3 normal; //geometric normal cross(B-A, C-A), not normalized
 
 		Triangle() {}
-		virtual bool hit(const Ray& ray, float& t_val);
-		virtual glm::vec3 interpolate(const glm::vec3& P);
 
+		//world space vertices A, B and C
+		Triangle(const glm::vec3& A, const glm::vec3& B, const glm::vec3& C);
+
+		//also reports the barycentric coordinates (beta, gamma) of the hit
+		bool hit(const Ray& ray, float t_min, float& t_val, glm::vec2& bary) const;
+		AABB bounds() const;
+};
+
+//indexed triangle mesh holding all triangles of the scene. the world
+//space vertices are stored once and every triangle refers to three of
+//them by 32-bit index. vertices from vertexnormal also carry a normal,
+//which is interpolated across the triangle for smooth shading
+class Mesh {
+	public:
+		std::vector<glm::vec3> positions; //world space
+		std::vector<glm::vec3> normals; //per vertex, zero if it has none. empty if no vertex has one
+		std::vector<uint32_t> indices; //three per triangle
+		std::vector<int> materials; //material table index per triangle
+
+		size_t size() const { return materials.size(); }
+
+		uint32_t addVertex(const glm::vec3& P);
+		uint32_t addVertex(const glm::vec3& P, const glm::vec3& N);
+		void addTriangle(uint32_t a, uint32_t b, uint32_t c, int material);
+
+		//triangle t with its edges precomputed, as the intersection kernels want it
+		Triangle triangle(size_t t) const;
+		//shading normal of triangle t at bary, smooth if its vertices have normals
+		glm::vec3 normal(size_t t, const glm::vec2& bary) const;
+		AABB bounds(size_t t) const;
+};
+
+//placement of a shape (see scene.h) in the world. the shape is stored
+//once in its own space with its own BVH, however often it is placed;
+//rays are transformed into that space to test it. the t of a hit is the
+//same in both spaces
+class Instance {
+	public:
+		int shape; //index into the scene's shapes
+		glm::mat4 trans; //shape to world
+		glm::mat4 inv_trans; //world to shape
+		AABB bounds; //world space, set when the BVHs are built
+
+		Instance() {}
+		Instance(int shape, const glm::mat4& M) : shape(shape), trans(M), inv_trans(glm::inverse(M)) {}
+
+		//world space normal from a shape space normal N
+		glm::vec3 normal(const glm::vec3& N) const;
+		//world space bounds of shape space bounds box
+		AABB transformBounds(const AABB& box) const;
 };
 
 //color class
@@ -105,3 +220,4 @@ class Light {
 		enum {point, directional} type;
 };
 
+#endif
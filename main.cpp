@@ -1,156 +1,788 @@
-#include "Intersection.cpp"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
 
-void saveScreenshot(Scene& scene, BYTE* pixels);
-BYTE* raytrace(Scene& scene); // the core function
-Ray rayThruPixel(Scene& cam, int i, int j);
+#include "Intersection.cpp"
+#include "scheduler.h"
+#include "raygen.h"
+
+const int tile_size = 16; // tiles are the unit of work handed to threads
+
+// how raytrace traces the pixels of a tile. the image is the same either
+// way, but for min_weight and roulette
+class RenderOptions {
+	public:
+		int packet_size = max_packet_size; //primary rays traced together, 0 for one ray at a time
+		bool wavefront = false; //the whole tile a depth at a time, see traceWavefront
+		bool sort_rays = false; //wavefront: sort each depth's reflection rays, see sortRays
+		float min_weight = 0.0f; //paths whose throughput falls below this end, see reflectPath
+		bool roulette = false; //below min_weight, paths end at random instead, unbiased
+};
+
+// reflection rays of a frame, counted by raytrace
+class PathStats {
+	public:
+		long traced = 0;
+		long non_specular = 0; //not traced, off surfaces without specular
+		long low_weight = 0; //not traced, their paths' weight was below min_weight
+};
+
+// buffers of a worker, kept from one packet or tile to the next, so that
+// tracing stops allocating once they have grown
+class TraceScratch {
+	public:
+		std::vector<char> lit; //lit[h * lights + l] for light l reaching hit h
+
+		// traceWavefront: the rays of the current depth and of the next,
+		// the pixels they belong to and the throughput of their paths
+		std::vector<Ray> queue, next_queue;
+		std::vector<int> pixels, next_pixels;
+		std::vector<glm::vec3> throughputs, next_throughputs;
+		std::vector<Intersection> hits;
+		std::vector<int> order; //the rays that hit, by material
+		std::vector<int> material_start;
+		std::vector<Ray> shadow_rays;
+		std::vector<float> shadow_dist;
+		std::vector<int> positions; //sort_rays: where each sorted ray was in the queue
+		RaySortScratch sort;
+};
+
+void saveScreenshot(Scene& scene, BYTE* pixels, const string& filename);
+std::vector<BYTE*> raytrace(Scene& scene, const std::vector<View>& views, int num_threads, const RenderOptions& options,
+							PathStats& stats); // the core function
+void tracePixels(const Scene& scene, const Ray* rays, int count, const RenderOptions& options, TraceScratch& scratch,
+				 PathStats& stats, Color* colors);
+void traceWavefront(const Scene& scene, const Ray* rays, int count, const RenderOptions& options, TraceScratch& scratch,
+					PathStats& stats, Color* colors);
 Color FindColor(const Intersection& hit); //test function
-Color findColor(const Intersection& hit, const Ray &ray, const Scene &scene, int depth);
+Color findColor(const Intersection& hit, const Ray &ray, const Scene &scene, const RenderOptions& options, PathStats& stats,
+				const char* lit = nullptr);
+
+// read the BVH option at argv[i] into options, moving i past its value.
+// false if argv[i] is not a BVH option
+bool bvhOption(int argc, char* argv[], int& i, BVH::Options& options) {
+	string arg = argv[i];
+	if (arg == "--bvh") {
+		if (++i >= argc || !BVH::parseMethod(argv[i], options.method)) {
+			cerr << "--bvh takes sweep, binned, lbvh or sbvh\n";
+			exit(-1);
+		}
+	}
+	else if (arg == "--bvh-width") {
+		options.width = ++i < argc ? atoi(argv[i]) : 0;
+		if (options.width < 2 || options.width > WideNode::width) {
+			cerr << "--bvh-width takes 2 to " << WideNode::width << " children\n";
+			exit(-1);
+		}
+	}
+	else if (arg == "--bvh-quantize")
+		options.quantize = true;
+	else if (arg == "--bvh-split-budget") {
+		options.split_budget = ++i < argc ? atof(argv[i]) : -1.0f;
+		if (!(options.split_budget >= 0.0f)) {
+			cerr << "--bvh-split-budget takes the extra references per primitive, 0 or more\n";
+			exit(-1);
+		}
+	}
+	else
+		return false;
+	return true;
+}
+
+// raytrace compile [--no-bvh] [bvh options] scene.test compiled.scene
+// parse a scene, build its BVH and save both as a compiled scene
+int compile(int argc, char* argv[]) {
+
+	bool with_bvh = true;
+	BVH::Options options;
+	const char* files[2];
+	int num_files = 0;
+
+	for (int i = 2; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "--no-bvh")
+			with_bvh = false;
+		else if (bvhOption(argc, argv, i, options))
+			continue;
+		else if (num_files < 2)
+			files[num_files++] = argv[i];
+		else {
+			cerr << "Unexpected argument: " << arg << "\n";
+			exit(-1);
+		}
+	}
+
+	if (num_files != 2) {
+		cerr << "Usage: raytrace compile [--no-bvh] [bvh options] scene.test compiled.scene\n";
+		exit(-1);
+	}
+
+	Scene scene;
+	scene.readfile(files[0]);
+	if (with_bvh)
+		scene.buildBVH(options);
+
+	return scene.save(files[1], with_bvh) ? 0 : -1;
+}
+
+// the spatial splits of all BVHs of the scene, for the build message
+string splitStats(const Scene& scene) {
+	int splits = scene.bvh.spatial_splits;
+	size_t references = scene.bvh.indices.size();
+	size_t primitives = scene.mesh.size() + scene.spheres.size() + scene.instances.size();
+	for (const Shape& shape : scene.shapes) {
+		splits += shape.bvh.spatial_splits;
+		references += shape.bvh.indices.size();
+		primitives += shape.mesh.size() + shape.spheres.size();
+	}
+	char stats[96];
+	snprintf(stats, sizeof(stats), ", %d spatial splits, %.1f%% more references", splits,
+		primitives ? 100.0 * (references - primitives) / primitives : 0.0);
+	return stats;
+}
+
+// reuse the cached BVH if the geometry is unchanged since it was cached,
+// otherwise build it and cache it for the next run. the cache file is
+// next to the scene, or named by the geometry hash in cache_dir
+void loadOrBuildBVH(Scene& scene, const char* scenefile, const char* cache_dir, const BVH::Options& options, int num_threads) {
+
+	typedef std::chrono::steady_clock Clock;
+	Clock::time_point start = Clock::now();
+
+	uint64_t hash = scene.geometryHash(options);
+	string cache_file;
+	if (cache_dir) {
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)hash);
+		cache_file = string(cache_dir) + "/" + name;
+	}
+	else
+		cache_file = string(scenefile) + ".bvh";
+
+	double build_seconds;
+	if (scene.loadBVH(cache_file.c_str(), hash, build_seconds)) {
+		double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		std::cout << "BVH cache hit: " << cache_file << ", loaded in " << seconds * 1e3
+			<< " ms, saved " << (build_seconds - seconds) * 1e3 << " ms" << std::endl;
+		return;
+	}
+
+	scene.buildBVH(options, num_threads);
+	build_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	std::cout << "BVH cache miss: " << BVH::methodName(options.method) << " build in " << build_seconds * 1e3 << " ms";
+	if (options.method == BVH::sbvh)
+		std::cout << splitStats(scene);
+	if (scene.saveBVH(cache_file.c_str(), hash, build_seconds))
+		std::cout << ", cached in " << cache_file << std::endl;
+	else
+		std::cout << ", unable to write " << cache_file << std::endl;
+}
+
+// read a frame range, first:last or a single frame
+bool parseFrames(const char* arg, int& first, int& last) {
+	char* end;
+	first = strtol(arg, &end, 10);
+	if (end == arg)
+		return false;
+	last = first;
+	if (*end == ':') {
+		const char* from = end + 1;
+		last = strtol(from, &end, 10);
+		if (end == from)
+			return false;
+	}
+	return *end == '\0' && first <= last;
+}
+
+// the output file of a frame of a sequence: the frame number goes before
+// the extension, so that raytrace.png becomes raytrace_0012.png
+string frameFilename(const string& outfilename, int frame) {
+	size_t dot = outfilename.rfind('.');
+	size_t slash = outfilename.rfind('/');
+	if (dot == string::npos || (slash != string::npos && dot < slash))
+		dot = outfilename.size();
+	char number[16];
+	snprintf(number, sizeof(number), "_%04d", frame);
+	return outfilename.substr(0, dot) + number + outfilename.substr(dot);
+}
+
+// the cameras to render and their files: the views of the scene, or
+// else its camera
+std::vector<View> sceneViews(const Scene& scene) {
+	if (!scene.views.empty())
+		return scene.views;
+	View view;
+	view.cam = scene.cam;
+	view.outfilename = scene.outfilename;
+	return std::vector<View>(1, view);
+}
 
 int main(int argc, char* argv[]) {
 
-	if (argc < 2) {
-		cerr << "Usage: scene txt file as an argument\n"; 
+	if (argc > 1 && string(argv[1]) == "compile")
+		return compile(argc, argv);
+
+	const char* scenefile = nullptr;
+	const char* cache_dir = nullptr;
+	bool use_cache = true;
+	BVH::Options options;
+	int num_threads = Scheduler::hardwareThreads();
+	int first_frame = 0, last_frame = 0;
+	bool frames_given = false;
+	RenderOptions render_options;
+
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if ((arg == "-t" || arg == "--threads") && i + 1 < argc) {
+			num_threads = atoi(argv[++i]);
+			if (num_threads < 1) {
+				cerr << "Thread count must be at least 1\n";
+				exit(-1);
+			}
+		}
+		else if (arg == "--bvh-cache" && i + 1 < argc)
+			cache_dir = argv[++i];
+		else if (arg == "--no-bvh-cache")
+			use_cache = false;
+		else if (arg == "--frames") {
+			if (++i >= argc || !parseFrames(argv[i], first_frame, last_frame)) {
+				cerr << "--frames takes first:last or a single frame\n";
+				exit(-1);
+			}
+			frames_given = true;
+		}
+		else if (arg == "--packets") {
+			int& packet_size = render_options.packet_size;
+			packet_size = ++i < argc ? atoi(argv[i]) : -1;
+			if (packet_size != 0 && packet_size != RayPacket::width && packet_size != max_packet_size) {
+				cerr << "--packets takes 0 (single rays), " << RayPacket::width << " or " << max_packet_size << "\n";
+				exit(-1);
+			}
+		}
+		else if (arg == "--wavefront")
+			render_options.wavefront = true;
+		else if (arg == "--sort-rays")
+			render_options.wavefront = render_options.sort_rays = true;
+		else if (arg == "--min-weight") {
+			render_options.min_weight = ++i < argc ? atof(argv[i]) : -1.0f;
+			if (!(render_options.min_weight >= 0.0f)) {
+				cerr << "--min-weight takes the path weight below which reflections stop, 0 or more\n";
+				exit(-1);
+			}
+		}
+		else if (arg == "--roulette")
+			render_options.roulette = true;
+		else if (bvhOption(argc, argv, i, options))
+			continue;
+		else if (!scenefile)
+			scenefile = argv[i];
+		else {
+			cerr << "Unexpected argument: " << arg << "\n";
+			exit(-1);
+		}
+	}
+
+	if (!scenefile) {
+		cerr << "Usage: raytrace [-t threads] [--frames first:last] [--packets 0|8|16]\n";
+		cerr << "                [--wavefront] [--sort-rays] [--min-weight w] [--roulette]\n";
+		cerr << "                [bvh options]\n";
+		cerr << "                [--bvh-cache dir|--no-bvh-cache]\n";
+		cerr << "                scene.test|compiled.scene\n"; 
+		cerr << "       raytrace compile [--no-bvh] [bvh options] scene.test compiled.scene\n"; 
+		cerr << "BVH options: --bvh sweep|binned|lbvh|sbvh, --bvh-width 2..8, --bvh-quantize,\n";
+		cerr << "             --bvh-split-budget extra_references_per_primitive (sbvh, default 0.3)\n"; 
 		exit(-1); 
 	}
 
 	FreeImage_Initialise();
 
+	typedef std::chrono::steady_clock Clock;
+	Clock::time_point start = Clock::now();
+
+	// compiled scenes are loaded as they are, text scenes parsed
 	Scene scene;
-	scene.readfile(argv[1]);
+	if (Scene::isCompiled(scenefile)) {
+		if (!scene.load(scenefile))
+			exit(-1);
+	}
+	else
+		scene.readfile(scenefile);
+
+	// camera keys move the scene's camera, which is not rendered once the
+	// scene names views
+	if (!scene.views.empty() && !scene.camera_keys.empty())
+		cerr << "Warning: " << scene.camera_keys.size() << " cameraKey commands ignored, the "
+			<< scene.views.size() << " views of the scene are not animated\n";
+
+	// a still scene renders once to its output file. a frame range, or
+	// the frames of the keys of an animated scene, render to a file per
+	// frame in one go: the scene is read once, and between frames only
+	// the camera and the instances that moved are updated
+	bool sequence = frames_given || scene.frameRange(first_frame, last_frame);
+
+	std::vector<int> moved;
+	for (int frame = first_frame; frame <= last_frame; frame++) {
+		Clock::time_point frame_start = Clock::now();
+		moved.clear();
+		scene.setFrame(frame, moved);
+
+		// compiled scenes may come with their BVH
+		const char* update = "";
+		if (scene.bvh.empty()) {
+			if (use_cache)
+				loadOrBuildBVH(scene, scenefile, cache_dir, options, num_threads);
+			else
+				scene.buildBVH(options, num_threads);
+		}
+		else if (!moved.empty())
+			update = scene.updateBVH(moved, options, num_threads) ? ", BVH rebuilt" : ", BVH refit";
 
-	BYTE* pixels = raytrace(scene);
+		std::vector<View> views = sceneViews(scene);
+		PathStats stats;
+		std::vector<BYTE*> images = raytrace(scene, views, num_threads, render_options, stats);
 
-	saveScreenshot(scene, pixels);
+		for (size_t v = 0; v < views.size(); v++) {
+			saveScreenshot(scene, images[v], sequence ? frameFilename(views[v].outfilename, frame) : views[v].outfilename);
+			delete [] images[v];
+		}
 
-	FreeImage_DeInitialise();
+		// saved against a reflection off every hit down to maxdepth
+		std::cout << "Reflection rays: " << stats.traced << " traced, " << stats.non_specular + stats.low_weight
+			<< " saved (" << stats.non_specular << " off non-specular surfaces, " << stats.low_weight
+			<< " below the minimum weight)" << std::endl;
 
-	delete [] pixels;
+		if (sequence) {
+			double seconds = std::chrono::duration<double>(Clock::now() - frame_start).count();
+			std::cout << "Frame " << frame << " in " << seconds * 1e3 << " ms, " << moved.size()
+				<< " instances moved" << update << std::endl;
+		}
+	}
 
-	for (Object* obj : scene.objects)
-		delete obj;
+	// throughput of the whole run, with reading the scene and the first build
+	double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	if (sequence) {
+		int frames = last_frame - first_frame + 1;
+		std::cout << "Rendered " << frames << " frames in " << seconds << " s, "
+			<< frames * 3600.0 / seconds << " frames per hour" << std::endl;
+	}
+	else if (scene.views.size() > 1)
+		std::cout << "Rendered " << scene.views.size() << " views in " << seconds << " s" << std::endl;
+
+	FreeImage_DeInitialise();
 
 	return 0;
 }
 
-//the main raytracing algorithm
-BYTE* raytrace(Scene& scene) {
-
-	BYTE* image = new BYTE[3 * scene.width * scene.height];
+//the main raytracing algorithm, an image per view. the images are cut
+//into tiles which are traced in parallel; every pixel is independent of
+//the others, so the result does not depend on the number of threads.
+//the tiles of all views are handed out together, so the threads stay
+//busy until the last view is done rather than waiting at every view's end
+//packet_size primary rays, one or two rows of 8 pixels, are traced
+//together with their shadow rays. 0 traces one ray at a time. wavefront
+//traces all the rays of a tile together instead. stats counts the
+//reflection rays of all views
+std::vector<BYTE*> raytrace(Scene& scene, const std::vector<View>& views, int num_threads, const RenderOptions& options,
+							PathStats& stats) {
+
+	std::vector<BYTE*> images;
+	for (size_t v = 0; v < views.size(); v++)
+		images.push_back(new BYTE[3 * scene.width * scene.height]);
+
+	int tiles_x = (scene.width + tile_size - 1) / tile_size;
+	int tiles_y = (scene.height + tile_size - 1) / tile_size;
+	int view_tiles = tiles_x * tiles_y;
+
+	// the camera rays are set up once per view, not per pixel
+	std::vector<RayGenerator> cameras;
+	for (const View& view : views)
+		cameras.push_back(RayGenerator(view.cam, scene.width, scene.height));
+
+	// counted and buffered per worker, so the threads do not share them
+	std::vector<PathStats> worker_stats(num_threads);
+	std::vector<TraceScratch> worker_scratch(num_threads);
+
+	Scheduler scheduler(num_threads);
+	scheduler.run((int)views.size() * view_tiles, [&](int task, int worker) {
+		const RayGenerator& camera = cameras[task / view_tiles];
+		BYTE* image = images[task / view_tiles];
+		int tile = task % view_tiles;
+		int i_begin = (tile / tiles_x) * tile_size;
+		int j_begin = (tile % tiles_x) * tile_size;
+		int i_end = std::min(i_begin + tile_size, scene.height);
+		int j_end = std::min(j_begin + tile_size, scene.width);
+
+		if (options.wavefront) {
+			RayPacket packet;
+			Ray rays[tile_size * tile_size];
+			Color colors[tile_size * tile_size];
+			int count = 0;
+			for (int i = i_begin; i < i_end; i++) {
+				for (int j = j_begin; j < j_end; j += RayPacket::width) {
+					camera.packet(i, j, packet);
+					for (int lane = 0; lane < std::min(packet.count, j_end - j); lane++)
+						rays[count++] = packet.ray(lane);
+				}
+			}
+
+			traceWavefront(scene, rays, count, options, worker_scratch[worker], worker_stats[worker], colors);
+
+			int width = j_end - j_begin;
+			for (int r = 0; r < count; r++) {
+				int byte_index = 3 * ((scene.height - (i_begin + r / width) - 1) * scene.width + j_begin + r % width);
+				image[byte_index] = colors[r].blueByte();
+				image[byte_index+1] = colors[r].greenByte();
+				image[byte_index+2] = colors[r].redByte();
+			}
+			return;
+		}
 
-	for (int i = 0; i < scene.height; i++) {
-		for (int j = 0; j < scene.width; j++) {
-			Ray ray = rayThruPixel(scene, i, j);
-			Intersection hit;
-			hit.intersect(ray,scene);
-			Color color = findColor(hit, ray, scene, 0);
-			int byte_index = 3 * ((scene.height-i-1) * scene.width + j);
-			image[byte_index] = color.blueByte();
-			image[byte_index+1] = color.greenByte();
-			image[byte_index+2] = color.redByte();
+		int packet_size = options.packet_size;
+		int rows = std::max(packet_size / RayPacket::width, 1);
+		RayPacket packet;
+		Ray rays[max_packet_size];
+		Color colors[max_packet_size];
+		for (int i = i_begin; i < i_end; i += rows) {
+			for (int j = j_begin; j < j_end; j += RayPacket::width) {
+				int num_rows = std::min(rows, i_end - i);
+				int num_columns = std::min(RayPacket::width, j_end - j);
+				for (int row = 0; row < num_rows; row++) {
+					camera.packet(i + row, j, packet);
+					for (int lane = 0; lane < num_columns; lane++)
+						rays[row * num_columns + lane] = packet.ray(lane);
+				}
+
+				tracePixels(scene, rays, num_rows * num_columns, options, worker_scratch[worker], worker_stats[worker], colors);
+
+				for (int row = 0; row < num_rows; row++) {
+					for (int lane = 0; lane < num_columns; lane++) {
+						Color& color = colors[row * num_columns + lane];
+						int byte_index = 3 * ((scene.height-(i+row)-1) * scene.width + j + lane);
+						image[byte_index] = color.blueByte();
+						image[byte_index+1] = color.greenByte();
+						image[byte_index+2] = color.redByte();
+					}
+				}
+			}
 		}
+	});
+
+	for (const PathStats& counted : worker_stats) {
+		stats.traced += counted.traced;
+		stats.non_specular += counted.non_specular;
+		stats.low_weight += counted.low_weight;
 	}
-	return image;
+	return images;
 }
 
-Ray rayThruPixel(Scene& scene, int i, int j) {
-	//construct orthonormal basis
-	glm::vec3 w = glm::normalize(scene.cam.eye - scene.cam.center);
-	glm::vec3 u = glm::normalize(glm::cross(scene.cam.up, w));
-	glm::vec3 v = glm::cross(w,u);
-
-	//find coeffs alpha and beta for the equation:
-	//ray = eye + norm(alpha*u + beta*v - w) * t
-
-	float tany = glm::tan(glm::radians(scene.cam.fovy) / 2.0f);
-	float tanx = tany * ((float)scene.width / (float)scene.height);
-
-	float alpha = tanx * (((j+0.5f)-(scene.width/2.0f)) / (scene.width/2.0f));
-	float beta = tany * (((scene.height/2.0f)-(i+0.5f)) / (scene.height/2.0f));
-
-	glm::vec3 direction;
+//the colors of count primary rays. as packets, the rays are intersected
+//together, and so are their shadow rays to each light, before they are
+//shaded. the colors are the same either way
+void tracePixels(const Scene& scene, const Ray* rays, int count, const RenderOptions& options, TraceScratch& scratch,
+				 PathStats& stats, Color* colors) {
+	if (options.packet_size == 0) {
+		for (int r = 0; r < count; r++) {
+			Intersection hit;
+			hit.intersect(rays[r], scene);
+			colors[r] = findColor(hit, rays[r], scene, options, stats);
+		}
+		return;
+	}
 
-	direction = glm::normalize(alpha*u + beta*v - w);
+	Intersection hits[max_packet_size];
+	intersectPacket(rays, count, hits, scene);
+
+	size_t num_lights = scene.lights.size();
+	std::vector<char>& lit = scratch.lit;
+	lit.resize(count * num_lights);
+	Ray shadow_rays[max_packet_size];
+	float shadow_dist[max_packet_size];
+	int shadow_pixels[max_packet_size];
+	for (size_t l = 0; l < num_lights; l++) {
+		int num_shadow = 0;
+		for (int r = 0; r < count; r++) {
+			if (!hits[r].isIntersected)
+				continue;
+			glm::vec3 dir;
+			lightDirection(scene.lights[l], hits[r].coord, dir, shadow_dist[num_shadow]);
+			shadow_rays[num_shadow] = Ray(hits[r].coord, dir);
+			shadow_pixels[num_shadow++] = r;
+		}
+		int blocked = occludedPacket(shadow_rays, shadow_dist, num_shadow, scene);
+		for (int s = 0; s < num_shadow; s++)
+			lit[shadow_pixels[s] * num_lights + l] = !(blocked & (1 << s));
+	}
 
-	return Ray(scene.cam.eye, direction);
+	for (int r = 0; r < count; r++)
+		colors[r] = findColor(hits[r], rays[r], scene, options, stats, lit.data() + r * num_lights);
 }
 
-void saveScreenshot(Scene& scene, BYTE* pixels) {
+void saveScreenshot(Scene& scene, BYTE* pixels, const string& filename) {
 	FIBITMAP *img = FreeImage_ConvertFromRawBits(pixels, scene.width, scene.height, scene.width * 3, 24, 0xFF0000, 0x00FF00, 0x0000FF, false);
-	std::cout << "Saving screenshot: " << scene.outfilename << std::endl;
-	FreeImage_Save(FIF_PNG, img, scene.outfilename.c_str(), 0);
+	std::cout << "Saving screenshot: " << filename << std::endl;
+	FreeImage_Save(FIF_PNG, img, filename.c_str(), 0);
+	FreeImage_Unload(img);
 }
 
-Color helpFindColor(const Light &light, const Intersection &hit, const Ray &ray, const glm::vec3& attenuation);
+Color helpFindColor(const Light &light, const Material &mat, const Intersection &hit, const glm::vec3 &normal, const Ray &ray, const glm::vec3& attenuation);
 
-Color findColor(const Intersection &hit, const Ray &ray, const Scene &scene, int depth)
+//the color of the surface at hit itself, without reflections: its ambient
+//and emission plus the lights that reach it. lit[l] tells if light l
+//reaches the hit, if its shadow ray was traced already. otherwise shade
+//traces it
+Color shade(const Intersection &hit, const Ray &ray, const glm::vec3 &norm, const Scene &scene, const char *lit)
 {
-    if (depth > scene.depth)
-        return BLACK; // base of recursion
-
-    if (!hit.isIntersected)
-        return BLACK;
+    const Material &mat = scene.materials[hit.material];
+    Color color(mat.ambient + mat.emission);
 
-    Color color(hit.object->ambient + hit.object->emission);
-    for (Light light : scene.lights)
+    for (size_t l = 0; l < scene.lights.size(); l++)
     {
-        if (light.type == Light::point)
-        {
-            Ray light_ray(light.coord, glm::normalize(hit.coord - light.coord));
+        const Light &light = scene.lights[l];
 
-            Intersection new_hit;
-            new_hit.intersect(light_ray, scene);
+        // shadow ray from the surface towards the light
+        glm::vec3 light_dir;
+        float light_dist;
+        lightDirection(light, hit.coord, light_dir, light_dist);
 
-            if (new_hit.isIntersected)
-            {
-                if (glm::dot(hit.coord - new_hit.coord, hit.coord - new_hit.coord) < epsilon)
-                {
-                    Color tmp_col = helpFindColor(light, hit, ray, scene.attenuation);
-                    color.R += tmp_col.R;
-                    color.G += tmp_col.G;
-                    color.B += tmp_col.B;
-                }
-            }
-        }
-        else if (light.type == Light::directional)
+        if (lit ? lit[l] : !occluded(hit.coord, light_dir, light_dist, scene))
         {
-            Color tmp_col = helpFindColor(light, hit, ray, scene.attenuation);
+            Color tmp_col = helpFindColor(light, mat, hit, norm, ray, scene.attenuation);
             color.R += tmp_col.R;
             color.G += tmp_col.G;
             color.B += tmp_col.B;
         }
     }
+    return color;
+}
 
-    float spec_r = hit.object->specular.x;
-    float spec_g = hit.object->specular.y;
-    float spec_b = hit.object->specular.z;
+//a number in [0, 1) that depends only on the ray, for the roulette, so
+//the image does not depend on the order the paths are traced in
+float rayRandom(const Ray &ray)
+{
+    float values[6] = {ray.origin.x, ray.origin.y, ray.origin.z, ray.direction.x, ray.direction.y, ray.direction.z};
+    uint32_t hash = 2166136261u;
+    for (float value : values)
+    {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        hash = (hash ^ bits) * 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return (hash >> 8) * (1.0f / 16777216.0f);
+}
 
-    bool isZero = spec_r < epsilon && spec_g < epsilon && spec_b < epsilon;
+//whether the path goes on from a hit on mat at depth with reflect_ray.
+//throughput is the product of the specular coefficients along the path,
+//what the color reflected at the next hit is weighed by. a path ends at
+//maxdepth, at a surface without specular, and once its weight (largest
+//coefficient) is below min_weight. with roulette it goes on then with
+//probability weight / min_weight instead, and its throughput is divided
+//by that probability, which keeps the image unbiased
+bool reflectPath(const Material &mat, int depth, const Scene &scene, const RenderOptions &options, const Ray &reflect_ray,
+                 glm::vec3 &throughput, PathStats &stats)
+{
+    if (depth >= scene.depth)
+        return false;
 
+    bool isZero = mat.specular.x < epsilon && mat.specular.y < epsilon && mat.specular.z < epsilon;
     if (isZero)
     {
-        glm::vec3 norm = hit.object->interpolate(hit.coord);
-        glm::vec3 reflect_dir = ray.direction - (norm * (2 * glm::dot(ray.direction, norm)));
-        Ray reflect_ray(hit.coord, reflect_dir);
+        stats.non_specular++;
+        return false;
+    }
 
-        Intersection recur_hit;
-        recur_hit.intersect(reflect_ray, scene);
-        Color recur_color = findColor(recur_hit, reflect_ray, scene, depth + 1);
+    throughput *= mat.specular;
+    float weight = std::max(throughput.x, std::max(throughput.y, throughput.z));
+    if (weight < options.min_weight)
+    {
+        float survival = weight / options.min_weight;
+        if (!options.roulette || rayRandom(reflect_ray) >= survival)
+        {
+            stats.low_weight++;
+            return false;
+        }
+        throughput /= survival;
+    }
+    stats.traced++;
+    return true;
+}
 
-        color.R += hit.object->specular.x * recur_color.R;
-        color.G += hit.object->specular.y * recur_color.G;
-        color.B += hit.object->specular.z * recur_color.B;
+//the color seen along ray, which hit hit. the path is followed from one
+//reflection to the next, while reflectPath lets it go on, each hit's
+//shaded color weighed by the path's throughput. lit is for the first hit,
+//as in shade
+Color findColor(const Intersection &hit, const Ray &ray, const Scene &scene, const RenderOptions &options, PathStats &stats,
+                const char *lit)
+{
+    Color color = BLACK;
+    glm::vec3 throughput(1.0f);
+    Intersection path_hit = hit;
+    Ray path_ray = ray;
+
+    for (int depth = 0; depth <= scene.depth && path_hit.isIntersected; depth++)
+    {
+        const Material &mat = scene.materials[path_hit.material];
+        glm::vec3 norm = path_hit.normal(scene);
+
+        Color shaded = shade(path_hit, path_ray, norm, scene, depth == 0 ? lit : nullptr);
+        color.R += throughput.x * shaded.R;
+        color.G += throughput.y * shaded.G;
+        color.B += throughput.z * shaded.B;
+
+        glm::vec3 reflect_dir = path_ray.direction - (norm * (2 * glm::dot(path_ray.direction, norm)));
+        Ray reflect_ray(path_hit.coord, reflect_dir);
+        if (!reflectPath(mat, depth, scene, options, reflect_ray, throughput, stats))
+            break;
+
+        path_ray = reflect_ray;
+        path_hit = Intersection();
+        path_hit.intersect(path_ray, scene);
     }
     return color;
 }
 
-Color helpFindColor(const Light &light, const Intersection &hit, const Ray &ray, const glm::vec3& attenuation)
+//the wavefront integrator: rather than following each pixel's path down
+//to the last reflection before the next pixel, as findColor does, all the
+//rays of a depth go through each stage together. they are intersected as
+//a stream, in packets, their hits sorted by material, and the hits shaded
+//in bulk, which queues the shadow rays, traced as a stream too, and the
+//reflection rays, the next depth's rays. every ray carries its path's
+//throughput and the colors are added up in findColor's order, so they are
+//the same. with sort_rays, the reflection rays are sorted before they are
+//intersected
+void traceWavefront(const Scene &scene, const Ray *rays, int count, const RenderOptions &options, TraceScratch &scratch,
+                    PathStats &stats, Color *colors)
+{
+    size_t num_lights = scene.lights.size();
+
+    std::vector<Ray> &queue = scratch.queue, &next_queue = scratch.next_queue;
+    std::vector<int> &pixels = scratch.pixels, &next_pixels = scratch.next_pixels;
+    std::vector<glm::vec3> &throughputs = scratch.throughputs, &next_throughputs = scratch.next_throughputs;
+    std::vector<Intersection> &hits = scratch.hits;
+    std::vector<int> &order = scratch.order;
+    std::vector<int> &material_start = scratch.material_start;
+    std::vector<char> &lit = scratch.lit;
+    std::vector<Ray> &shadow_rays = scratch.shadow_rays;
+    std::vector<float> &shadow_dist = scratch.shadow_dist;
+
+    queue.assign(rays, rays + count);
+    pixels.resize(count);
+    throughputs.assign(count, glm::vec3(1.0f));
+    for (int r = 0; r < count; r++)
+    {
+        pixels[r] = r;
+        colors[r] = BLACK;
+    }
+
+    for (int depth = 0; depth <= scene.depth && !queue.empty(); depth++)
+    {
+        int num_rays = queue.size();
+        if (options.sort_rays && depth > 0)
+        {
+            // the pixels and throughputs follow the rays through their
+            // positions in the queue, gathered into the unused next buffers
+            std::vector<int> &positions = scratch.positions;
+            positions.resize(num_rays);
+            for (int r = 0; r < num_rays; r++)
+                positions[r] = r;
+            sortRays(queue.data(), positions.data(), num_rays, scratch.sort);
+            next_pixels.resize(num_rays);
+            next_throughputs.resize(num_rays);
+            for (int r = 0; r < num_rays; r++)
+            {
+                next_pixels[r] = pixels[positions[r]];
+                next_throughputs[r] = throughputs[positions[r]];
+            }
+            pixels.swap(next_pixels);
+            throughputs.swap(next_throughputs);
+        }
+
+        // intersect the whole queue
+        hits.assign(num_rays, Intersection());
+        for (int r = 0; r < num_rays; r += max_packet_size)
+            intersectPacket(&queue[r], std::min(max_packet_size, num_rays - r), &hits[r], scene);
+
+        // sort the hits by material, a counting sort that keeps the order of
+        // the rays within a material. misses are dropped
+        material_start.assign(scene.materials.size() + 1, 0);
+        for (int r = 0; r < num_rays; r++)
+            if (hits[r].isIntersected)
+                material_start[hits[r].material + 1]++;
+        for (size_t m = 1; m < material_start.size(); m++)
+            material_start[m] += material_start[m - 1];
+        order.resize(material_start.back());
+        for (int r = 0; r < num_rays; r++)
+            if (hits[r].isIntersected)
+                order[material_start[hits[r].material]++] = r;
+        int num_hits = order.size();
+
+        // shadow rays of every hit towards every light, light by light
+        lit.assign(num_hits * num_lights, 0);
+        for (size_t l = 0; l < num_lights; l++)
+        {
+            shadow_rays.resize(num_hits);
+            shadow_dist.resize(num_hits);
+            for (int h = 0; h < num_hits; h++)
+            {
+                glm::vec3 dir;
+                lightDirection(scene.lights[l], hits[order[h]].coord, dir, shadow_dist[h]);
+                shadow_rays[h] = Ray(hits[order[h]].coord, dir);
+            }
+            for (int h = 0; h < num_hits; h += max_packet_size)
+            {
+                int num_shadow = std::min(max_packet_size, num_hits - h);
+                int blocked = occludedPacket(&shadow_rays[h], &shadow_dist[h], num_shadow, scene);
+                for (int s = 0; s < num_shadow; s++)
+                    lit[(h + s) * num_lights + l] = !(blocked & (1 << s));
+            }
+        }
+
+        // shade, queueing the reflection rays for the next depth
+        next_queue.clear();
+        next_pixels.clear();
+        next_throughputs.clear();
+        for (int h = 0; h < num_hits; h++)
+        {
+            int r = order[h];
+            const Intersection &hit = hits[r];
+            const Ray &ray = queue[r];
+            const Material &mat = scene.materials[hit.material];
+            glm::vec3 norm = hit.normal(scene);
+            glm::vec3 throughput = throughputs[r];
+
+            Color shaded = shade(hit, ray, norm, scene, lit.data() + h * num_lights);
+            Color &color = colors[pixels[r]];
+            color.R += throughput.x * shaded.R;
+            color.G += throughput.y * shaded.G;
+            color.B += throughput.z * shaded.B;
+
+            glm::vec3 reflect_dir = ray.direction - (norm * (2 * glm::dot(ray.direction, norm)));
+            Ray reflect_ray(hit.coord, reflect_dir);
+            if (reflectPath(mat, depth, scene, options, reflect_ray, throughput, stats))
+            {
+                next_queue.push_back(reflect_ray);
+                next_pixels.push_back(pixels[r]);
+                next_throughputs.push_back(throughput);
+            }
+        }
+        queue.swap(next_queue);
+        pixels.swap(next_pixels);
+        throughputs.swap(next_throughputs);
+    }
+}
+
+Color helpFindColor(const Light &light, const Material &mat, const Intersection &hit, const glm::vec3 &normal, const Ray &ray, const glm::vec3& attenuation)
 {
     glm::vec3 dir = (light.type == Light::point) ? glm::normalize(light.coord - hit.coord) : glm::normalize(light.coord);
 
-    glm::vec3 norm = glm::normalize(hit.object->interpolate(hit.coord));
+    glm::vec3 norm = glm::normalize(normal);
 
 	float nDotL = std::max(glm::dot(norm, dir), 0.0f);
-   	Color diffuse(hit.object->diffuse);
+   	Color diffuse(mat.diffuse);
     diffuse.R *= light.color.R * nDotL;
     diffuse.G *= light.color.G * nDotL;
     diffuse.B *= light.color.B * nDotL;
@@ -159,8 +791,8 @@ Color helpFindColor(const Light &light, const Intersection &hit, const Ray &ray,
 
 	float nDotH = std::max(glm::dot(norm, halfvec), 0.0f);
     
-    Color specular(hit.object->specular);
-	float exp = std::pow(nDotH, hit.object->shininess);
+    Color specular(mat.specular);
+	float exp = std::pow(nDotH, mat.shininess);
     specular.R *= light.color.R * exp;
     specular.G *= light.color.G * exp;
     specular.B *= light.color.B * exp;
@@ -0,0 +1,52 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mappedfile.h"
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const char *filename)
+{
+    close();
+
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    // an empty file has nothing to map
+    if (info.st_size > 0)
+    {
+        void *map = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            ::close(fd);
+            return false;
+        }
+        madvise(map, info.st_size, MADV_SEQUENTIAL);
+        bytes = (const char *)map;
+        length = info.st_size;
+    }
+
+    ::close(fd); // the mapping stays valid without the descriptor
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (bytes)
+        munmap((void *)bytes, length);
+    bytes = nullptr;
+    length = 0;
+}
@@ -0,0 +1,29 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+
+//read only view of a whole file. the file is memory mapped, so reading a
+//large scene neither copies it nor allocates for it; pages are brought in
+//as they are touched
+class MappedFile {
+	public:
+		MappedFile() {}
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		//map filename, returns false if it cannot be opened or mapped
+		bool open(const char* filename);
+		void close();
+
+		const char* data() const { return bytes; }
+		size_t size() const { return length; }
+
+	private:
+		const char* bytes = nullptr;
+		size_t length = 0;
+};
+
+#endif
@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <cmath>
+
+#include "raygen.h"
+#include "scene.h"
+
+RayGenerator::RayGenerator(const Camera &cam, int width, int height) : eye(cam.eye), columns(width), rows(height)
+{
+    // construct orthonormal basis
+    w = glm::normalize(cam.eye - cam.center);
+    glm::vec3 u = glm::normalize(glm::cross(cam.up, w));
+    glm::vec3 v = glm::cross(w, u);
+
+    // find coeffs alpha and beta for the equation:
+    // ray = eye + norm(alpha*u + beta*v - w) * t
+
+    float tany = glm::tan(glm::radians(cam.fovy) / 2.0f);
+    float tanx = tany * ((float)width / (float)height);
+
+    for (int j = 0; j < width; j++)
+    {
+        float alpha = tanx * (((j + 0.5f) - (width / 2.0f)) / (width / 2.0f));
+        columns[j] = alpha * u;
+    }
+    for (int i = 0; i < height; i++)
+    {
+        float beta = tany * (((height / 2.0f) - (i + 0.5f)) / (height / 2.0f));
+        rows[i] = beta * v;
+    }
+}
+
+Ray RayGenerator::ray(int i, int j) const
+{
+    return Ray(eye, glm::normalize(columns[j] + rows[i] - w));
+}
+
+void RayGenerator::packet(int i, int j, RayPacket &packet) const
+{
+    const int last = columns.size() - 1;
+    const glm::vec3 &offset = rows[i];
+
+    packet.origin = eye;
+    packet.count = std::min(RayPacket::width, last + 1 - j);
+
+    // lanes past the end of the row repeat its last pixel
+    for (int lane = 0; lane < RayPacket::width; lane++)
+    {
+        const glm::vec3 &column = columns[std::min(j + lane, last)];
+        packet.dir_x[lane] = column.x + offset.x - w.x;
+        packet.dir_y[lane] = column.y + offset.y - w.y;
+        packet.dir_z[lane] = column.z + offset.z - w.z;
+    }
+
+    // normalize as glm::normalize does, a lane at a time
+    for (int lane = 0; lane < RayPacket::width; lane++)
+    {
+        float x = packet.dir_x[lane], y = packet.dir_y[lane], z = packet.dir_z[lane];
+        float inv_length = 1.0f / std::sqrt(x * x + y * y + z * z);
+        packet.dir_x[lane] = x * inv_length;
+        packet.dir_y[lane] = y * inv_length;
+        packet.dir_z[lane] = z * inv_length;
+    }
+}
+
+void RayGenerator::row(int i, Ray *rays) const
+{
+    RayPacket packet;
+    for (int j = 0; j < (int)columns.size(); j += RayPacket::width)
+    {
+        this->packet(i, j, packet);
+        for (int lane = 0; lane < packet.count; lane++)
+            rays[j + lane] = packet.ray(lane);
+    }
+}
+
+// spread the low 10 bits of x out to every third bit
+static inline uint32_t spreadBits(uint32_t x)
+{
+    x &= 0x3ff;
+    x = (x | x << 16) & 0x30000ff;
+    x = (x | x << 8) & 0x300f00f;
+    x = (x | x << 4) & 0x30c30c3;
+    x = (x | x << 2) & 0x9249249;
+    return x;
+}
+
+void sortRays(Ray *rays, int *ids, int count, RaySortScratch &scratch)
+{
+    if (count < 2)
+        return;
+
+    glm::vec3 lo = rays[0].origin, hi = rays[0].origin;
+    for (int r = 1; r < count; r++)
+    {
+        lo = glm::min(lo, rays[r].origin);
+        hi = glm::max(hi, rays[r].origin);
+    }
+    glm::vec3 extent = hi - lo;
+    glm::vec3 scale(extent.x > 0.0f ? 1023.0f / extent.x : 0.0f, extent.y > 0.0f ? 1023.0f / extent.y : 0.0f,
+                    extent.z > 0.0f ? 1023.0f / extent.z : 0.0f);
+
+    // the octant in the top 3 bits and a 30-bit Morton code below, with
+    // the ray's position to keep equal keys in order
+    std::vector<uint64_t> &keys = scratch.keys;
+    keys.resize(count);
+    for (int r = 0; r < count; r++)
+    {
+        const Ray &ray = rays[r];
+        glm::vec3 cell = (ray.origin - lo) * scale;
+        uint32_t octant = (ray.direction.x < 0.0f) | (ray.direction.y < 0.0f) << 1 | (ray.direction.z < 0.0f) << 2;
+        uint32_t morton = spreadBits((uint32_t)cell.x) << 2 | spreadBits((uint32_t)cell.y) << 1 | spreadBits((uint32_t)cell.z);
+        keys[r] = (uint64_t)octant << 61 | (uint64_t)morton << 31 | (uint32_t)r;
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<Ray> &sorted_rays = scratch.rays;
+    std::vector<int> &sorted_ids = scratch.ids;
+    sorted_rays.resize(count);
+    sorted_ids.resize(count);
+    for (int r = 0; r < count; r++)
+    {
+        int from = (int)(keys[r] & 0x7fffffff);
+        sorted_rays[r] = rays[from];
+        sorted_ids[r] = ids[from];
+    }
+    std::copy(sorted_rays.begin(), sorted_rays.end(), rays);
+    std::copy(sorted_ids.begin(), sorted_ids.end(), ids);
+}
@@ -0,0 +1,62 @@
+#ifndef RAYGEN_H
+#define RAYGEN_H
+
+#include <cstdint>
+#include <vector>
+
+#include "geometry.h"
+
+class Camera;
+
+//the primary rays of 8 pixels next to each other in a row, in structure
+//of arrays layout. they all start at the eye
+class alignas(32) RayPacket {
+	public:
+		static const int width = 8;
+
+		glm::vec3 origin;
+		float dir_x[width], dir_y[width], dir_z[width]; //normalized
+		int count; //rays in use, fewer at the end of a row
+
+		Ray ray(int lane) const { return Ray(origin, glm::vec3(dir_x[lane], dir_y[lane], dir_z[lane])); }
+};
+
+//primary rays of a camera for an image size. the basis of the camera and
+//the offsets of every column (along u) and row (along v) on the image
+//plane are computed once, so a ray is two adds and a normalize. row i
+//counts from the top. the directions are computed in the same order as
+//from the camera directly, so the images do not change
+class RayGenerator {
+	public:
+		RayGenerator(const Camera& cam, int width, int height);
+
+		Ray ray(int i, int j) const;
+		//the rays of pixels j up to j + 7 of row i, or up to the end of the row
+		void packet(int i, int j, RayPacket& packet) const;
+		//the rays of row i, width of them
+		void row(int i, Ray* rays) const;
+
+	private:
+		glm::vec3 eye;
+		glm::vec3 w; //from the image plane to the eye
+		std::vector<glm::vec3> columns; //alpha * u of every column
+		std::vector<glm::vec3> rows; //beta * v of every row
+};
+
+//buffers of sortRays, kept by the caller from one call to the next so
+//that sorting does not allocate once they have grown
+class RaySortScratch {
+	public:
+		std::vector<uint64_t> keys;
+		std::vector<Ray> rays;
+		std::vector<int> ids;
+};
+
+//reorder count rays, and ids along with them, so that rays going the same
+//way from nearby origins are next to each other: by the octant of their
+//direction, then along a Morton curve through their origins, within the
+//bounds of the origins. secondary rays come out coherent enough for
+//packets and for the BVH nodes they visit to stay in cache
+void sortRays(Ray* rays, int* ids, int count, RaySortScratch& scratch);
+
+#endif
@@ -1,5 +1,10 @@
+#include <charconv>
+#include <cmath>
+#include <cstring>
+
 #include "scene.h"
 #include "transform.h"
+#include "mappedfile.h"
 
 typedef unsigned int uint;
 
@@ -13,15 +18,121 @@ void Scene::rightmultiply(const glm::mat4 &M, stack<glm::mat4> &transfstack)
 {
 	glm::mat4 &T = transfstack.top();
 	T = T * M;
+	transform_epoch++;
+}
+
+static inline bool isSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+bool LineTokens::next(std::string_view &token)
+{
+	while (p < end && isSpace(*p))
+		p++;
+	if (p == end)
+		return false;
+
+	const char *begin = p;
+	while (p < end && !isSpace(*p))
+		p++;
+	token = std::string_view(begin, p - begin);
+	return true;
+}
+
+// reads a number the way operator>> does: leading whitespace and a plus
+// sign are skipped, and the number ends at the first character that cannot
+// continue it
+bool LineTokens::next(float &value)
+{
+	while (p < end && isSpace(*p))
+		p++;
+
+	const char *begin = p;
+	if (end - begin > 1 && begin[0] == '+' && begin[1] != '-')
+		begin++;
+
+	std::from_chars_result result = std::from_chars(begin, end, value);
+	if (result.ec != std::errc())
+		return false;
+	p = result.ptr;
+	return true;
+}
+
+// scene file commands
+enum class Command
+{
+	unknown, size, maxdepth, output, camera,
+	sphere, maxverts, maxvertsnorms, vertex, vertexnormal, tri, trinormal,
+	translate, scale, rotate, pushTransform, popTransform,
+	beginMesh, endMesh, instance,
+	cameraKey, transformKey,
+	directional, point, attenuation,
+	ambient, diffuse, specular, emission, shininess
+};
+
+// FNV-1a. constexpr so that it can label the cases of the command switch,
+// where the compiler rejects two commands with the same hash
+constexpr uint32_t commandHash(std::string_view name)
+{
+	uint32_t hash = 2166136261u;
+	for (char c : name)
+	{
+		hash ^= (unsigned char)c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// an unknown name can have the hash of a command, so compare it as well
+static inline Command match(std::string_view name, std::string_view command_name, Command command)
+{
+	return name == command_name ? command : Command::unknown;
+}
+
+static Command lookupCommand(std::string_view name)
+{
+	switch (commandHash(name))
+	{
+		case commandHash("size"): return match(name, "size", Command::size);
+		case commandHash("maxdepth"): return match(name, "maxdepth", Command::maxdepth);
+		case commandHash("output"): return match(name, "output", Command::output);
+		case commandHash("camera"): return match(name, "camera", Command::camera);
+		case commandHash("sphere"): return match(name, "sphere", Command::sphere);
+		case commandHash("maxverts"): return match(name, "maxverts", Command::maxverts);
+		case commandHash("maxvertsnorms"): return match(name, "maxvertsnorms", Command::maxvertsnorms);
+		case commandHash("vertex"): return match(name, "vertex", Command::vertex);
+		case commandHash("vertexnormal"): return match(name, "vertexnormal", Command::vertexnormal);
+		case commandHash("tri"): return match(name, "tri", Command::tri);
+		case commandHash("trinormal"): return match(name, "trinormal", Command::trinormal);
+		case commandHash("translate"): return match(name, "translate", Command::translate);
+		case commandHash("scale"): return match(name, "scale", Command::scale);
+		case commandHash("rotate"): return match(name, "rotate", Command::rotate);
+		case commandHash("pushTransform"): return match(name, "pushTransform", Command::pushTransform);
+		case commandHash("popTransform"): return match(name, "popTransform", Command::popTransform);
+		case commandHash("beginMesh"): return match(name, "beginMesh", Command::beginMesh);
+		case commandHash("endMesh"): return match(name, "endMesh", Command::endMesh);
+		case commandHash("instance"): return match(name, "instance", Command::instance);
+		case commandHash("cameraKey"): return match(name, "cameraKey", Command::cameraKey);
+		case commandHash("transformKey"): return match(name, "transformKey", Command::transformKey);
+		case commandHash("directional"): return match(name, "directional", Command::directional);
+		case commandHash("point"): return match(name, "point", Command::point);
+		case commandHash("attenuation"): return match(name, "attenuation", Command::attenuation);
+		case commandHash("ambient"): return match(name, "ambient", Command::ambient);
+		case commandHash("diffuse"): return match(name, "diffuse", Command::diffuse);
+		case commandHash("specular"): return match(name, "specular", Command::specular);
+		case commandHash("emission"): return match(name, "emission", Command::emission);
+		case commandHash("shininess"): return match(name, "shininess", Command::shininess);
+		default: return Command::unknown;
+	}
 }
 
 // Function to read the input data values
-bool Scene::readvals(stringstream &s, const int numvals, float *values)
+bool Scene::readvals(LineTokens &s, const int numvals, float *values)
 {
 	for (int i = 0; i < numvals; i++)
 	{
-		s >> values[i];
-		if (s.fail())
+		if (!s.next(values[i]))
 		{
 			cout << "Failed reading value " << i << " will skip\n";
 			return false;
@@ -30,36 +141,140 @@ bool Scene::readvals(stringstream &s, const int numvals, float *values)
 	return true;
 }
 
+// index of the current material state in the material table, which
+// gets a new entry only the first time a material is used
+int Scene::currentMaterial()
+{
+	std::array<float, 13> key = {
+		ambient[0], ambient[1], ambient[2],
+		diffuse[0], diffuse[1], diffuse[2],
+		specular[0], specular[1], specular[2],
+		emission[0], emission[1], emission[2],
+		shininess};
+
+	auto found = material_ids.find(key);
+	if (found != material_ids.end())
+		return found->second;
+
+	Material material;
+	material.ambient = glm::vec3(ambient[0], ambient[1], ambient[2]);
+	material.diffuse = glm::vec3(diffuse[0], diffuse[1], diffuse[2]);
+	material.specular = glm::vec3(specular[0], specular[1], specular[2]);
+	material.emission = glm::vec3(emission[0], emission[1], emission[2]);
+	material.shininess = shininess;
+	materials.push_back(material);
+
+	material_ids[key] = materials.size() - 1;
+	return materials.size() - 1;
+}
+
+// the shape of an instanced sphere. spheres with the same center, radius
+// and material share one, only their transforms differ
+int Scene::sphereShape(const Sphere &sphere)
+{
+	std::array<float, 5> key = {sphere.center.x, sphere.center.y, sphere.center.z, sphere.radius, (float)sphere.material};
+
+	auto found = sphere_shape_ids.find(key);
+	if (found != sphere_shape_ids.end())
+		return found->second;
+
+	shapes.push_back(Shape());
+	shapes.back().spheres.push_back(sphere);
+	sphere_shape_ids[key] = shapes.size() - 1;
+	return shapes.size() - 1;
+}
+
+// place shape under transform M, which applies under animation unless it
+// is -1. an animated instance starts at the first key of its animation
+void Scene::addInstance(int shape, const glm::mat4 &M, int animation)
+{
+	if (animation < 0)
+	{
+		instances.push_back(Instance(shape, M));
+		return;
+	}
+
+	const Animation &placed = animations[animation];
+	AnimatedInstance animated = {(int)instances.size(), animation, M};
+	animated_instances.push_back(animated);
+	instances.push_back(Instance(shape, placed.parent * transform_keys[placed.first_key].matrix() * M));
+}
+
+// index in target of vertex v (of vertnorms if with_normal) under transform M.
+// a vertex is transformed and added to the mesh once per transform epoch,
+// later triangles under the same transform share it.
+// returns false if there is no vertex v
+bool Scene::meshVertex(int v, bool with_normal, const glm::mat4 &M, Mesh &target, uint32_t &id)
+{
+	std::vector<glm::vec3> &verts = with_normal ? vertnorms : vertices;
+	std::vector<uint32_t> &ids = with_normal ? vertnorm_ids : vertex_ids;
+	std::vector<int> &epochs = with_normal ? vertnorm_epochs : vertex_epochs;
+
+	if (v < 0 || v >= (int)verts.size())
+		return false;
+
+	if (epochs[v] != transform_epoch)
+	{
+		glm::vec4 P4 = M * glm::vec4(verts[v], 1.0f);
+		glm::vec3 P = glm::vec3(P4) / P4.w;
+		if (with_normal)
+		{
+			// normals transform with the inverse transpose
+			glm::vec3 N = glm::transpose(glm::inverse(glm::mat3(M))) * norms[v];
+			if (glm::dot(N, N) > 0.0f)
+				N = glm::normalize(N);
+			ids[v] = target.addVertex(P, N);
+		}
+		else
+		{
+			ids[v] = target.addVertex(P);
+		}
+		epochs[v] = transform_epoch;
+	}
+	id = ids[v];
+	return true;
+}
+
 void Scene::readfile(const char *filename)
 {
 
-	string str, cmd;
-	ifstream in;
-	in.open(filename);
-	if (in.is_open())
+	// the file is tokenized in place, nothing is copied per line
+	MappedFile in;
+	if (in.open(filename))
 	{
 
 		// matrix stack to store transforms.
 		stack<glm::mat4> transfstack;
 		transfstack.push(glm::mat4(1.0)); // identity
+		// animation in effect at each level of the stack, -1 for none
+		std::vector<int> animstack(1, -1);
 
-		getline(in, str);
-		while (in)
+		const char *line = in.data();
+		const char *file_end = line + in.size();
+		while (line < file_end)
 		{
-			if ((str.find_first_not_of(" \t\r\n") != string::npos) && (str[0] != '#'))
+			const char *line_end = (const char *)memchr(line, '\n', file_end - line);
+			if (!line_end)
+				line_end = file_end;
+
+			LineTokens s(line, line_end);
+			line = line_end < file_end ? line_end + 1 : file_end;
+
+			std::string_view cmd;
+			if (*s.p != '#' && s.next(cmd))
 			{
 				// Ruled out comment and blank lines
 
-				stringstream s(str);
-				s >> cmd;
 				int i;
-				float values[10]; // Position and color for light, colors for others
-				// Up to 10 params for cameras.
+				float values[11]; // Position and color for light, colors for others
+				// Up to 10 params for cameras, 11 for keyframes.
 				bool validinput; // Validity of input
 				//------------------------------------------------------------------------
 				//
 				// ----------------THE FOLLOWING PARSES GENERAL COMMANDS-----------------
-				if (cmd == "size")
+				switch (lookupCommand(cmd))
+				{
+				case Command::size:
 				{
 					validinput = readvals(s, 2, values);
 					if (validinput)
@@ -67,95 +282,115 @@ void Scene::readfile(const char *filename)
 						width = (int)values[0];
 						height = (int)values[1];
 					}
+					break;
 				}
-				else if (cmd == "maxdepth")
+				case Command::maxdepth:
 				{
 					validinput = readvals(s, 1, values);
 					if (validinput)
 					{
 						depth = values[0];
 					}
+					break;
 				}
-				else if (cmd == "output")
+				case Command::output:
 				{
-					string file;
-					s >> file;
-					if (!s.fail())
+					std::string_view file;
+					if (s.next(file))
 					{
-						outfilename = file;
+						outfilename = std::string(file);
 					}
 					else
 					{
 						cout << "Failed reading value, will skip\n";
 					}
+					break;
 				}
 				//---------------------------------------------------------------------
 				//
 				//--------------THE FOLLOWING PARSES CAMERA----------------------------
 				//
-				else if (cmd == "camera")
+				case Command::camera:
 				{
 					validinput = readvals(s, 10, values); // 10 values eye cen up fov
 					if (validinput)
 					{
-						for (int i = 0; i < 3; i++)
+						Camera camera(glm::vec3(values[0], values[1], values[2]), glm::vec3(values[3], values[4], values[5]),
+									  glm::vec3(values[6], values[7], values[8]), values[9]);
+
+						// a camera followed by a file name is one more view,
+						// else it is the camera rendered to output
+						std::string_view file;
+						if (s.next(file))
+						{
+							View view;
+							view.cam = camera;
+							view.outfilename = std::string(file);
+							views.push_back(view);
+						}
+						else
 						{
-							cam.eye[i] = values[i];
-							cam.center[i] = values[i + 3];
-							cam.up[i] = values[i + 6];
+							cam = camera;
 						}
-						cam.fovy = values[9];
 					}
+					break;
 				}
 				//----------------------------------------------------------------------
 
 				// --------THE FOLLOWING PARSES GEOMETRY----------
-				else if (cmd == "sphere")
+				case Command::sphere:
 				{
 					validinput = readvals(s, 4, values);
 					if (validinput)
 					{
-						Sphere* sphere = new Sphere();
-						sphere->type = Object::sphere;
+						Sphere sphere;
 
 						// save center coords and radius
 						for (int i = 0; i < 3; i++)
 						{
-							sphere->center[i] = values[i];
+							sphere.center[i] = values[i];
 						}
-						sphere->radius = values[3];
+						sphere.radius = values[3];
 
 						// save material properties
-						sphere->diffuse = glm::vec3(diffuse[0], diffuse[1], diffuse[2]);
-						sphere->specular = glm::vec3(specular[0], specular[1], specular[2]);
-						sphere->emission = glm::vec3(emission[0], emission[1], emission[2]);
-						sphere->ambient = glm::vec3(ambient[0], ambient[1], ambient[2]);
-						sphere->shininess = shininess;
+						sphere.material = currentMaterial();
 
-						// save transormation matrix
-						sphere->trans = transfstack.top();
-						sphere->inv_trans = glm::inverse(sphere->trans);
-
-						objects.push_back(sphere);
+						// flatten into world space if the transform allows and
+						// is not animated, else place it as an instance
+						if (animstack.back() < 0 && sphere.flatten(transfstack.top()))
+						{
+							(current_shape < 0 ? spheres : shapes[current_shape].spheres).push_back(sphere);
+						}
+						else if (current_shape >= 0)
+						{
+							cout << "Spheres in a mesh must keep their shape under its transforms, will skip\n";
+						}
+						else
+						{
+							addInstance(sphereShape(sphere), transfstack.top(), animstack.back());
+						}
 					}
+					break;
 				}
-				else if (cmd == "maxverts")
+				case Command::maxverts:
 				{
 					validinput = readvals(s, 1, values);
 					if (validinput)
 					{
 						maxverts = values[0];
 					}
+					break;
 				}
-				else if (cmd == "maxvertsnorms")
+				case Command::maxvertsnorms:
 				{
 					validinput = readvals(s, 1, values);
 					if (validinput)
 					{
 						maxvertnorms = values[0];
 					}
+					break;
 				}
-				else if (cmd == "vertex")
+				case Command::vertex:
 				{
 					validinput = readvals(s, 3, values);
 					if (validinput)
@@ -166,9 +401,12 @@ void Scene::readfile(const char *filename)
 							vert[i] = values[i];
 						}
 						vertices.push_back(vert);
+						vertex_ids.push_back(0);
+						vertex_epochs.push_back(-1);
 					}
+					break;
 				}
-				else if (cmd == "vertexnormal")
+				case Command::vertexnormal:
 				{
 					validinput = readvals(s, 6, values);
 					if (validinput)
@@ -186,84 +424,82 @@ void Scene::readfile(const char *filename)
 
 						vertnorms.push_back(vert);
 						norms.push_back(norm);
+						vertnorm_ids.push_back(0);
+						vertnorm_epochs.push_back(-1);
 					}
+					break;
 				}
-				else if (cmd == "tri")
+				case Command::tri:
+				case Command::trinormal:
 				{
 					validinput = readvals(s, 3, values);
 					if (validinput)
 					{
-						Triangle* triangle = new Triangle();
-						triangle->type = Object::triangle;
-						triangle->areNorms = false;
-						// save its coords
+						// tri indexes the vertex list, trinormal the vertexnormal list.
+						// the world space vertices are shared with other triangles
+						// a skipped triangle must not add its vertices to the mesh, so
+						// it is checked in full first. the indices are checked before
+						// they are converted, a float too large for an int cannot be
+						bool with_normal = cmd == "trinormal";
+						double num_verts = with_normal ? vertnorms.size() : vertices.size();
+						bool found = true;
 						for (int i = 0; i < 3; i++)
-							triangle->vertices[i] = vertices[values[i]];
-
-						// save material properties
-						triangle->diffuse = glm::vec3(diffuse[0], diffuse[1], diffuse[2]);
-						triangle->specular = glm::vec3(specular[0], specular[1], specular[2]);
-						triangle->emission = glm::vec3(emission[0], emission[1], emission[2]);
-						triangle->ambient = glm::vec3(ambient[0], ambient[1], ambient[2]);
-						triangle->shininess = shininess;
-
-						// save transormation matrix
-						triangle->trans = transfstack.top();
-						triangle->inv_trans = glm::inverse(transfstack.top());
-
-						objects.push_back(triangle);
-					}
-				}
-				else if (cmd == "trinormal")
-				{
-					validinput = readvals(s, 6, values);
-					if (validinput)
-					{
-						Triangle* triangle = new Triangle();
-						triangle->type = Object::triangle;
-						triangle->areNorms = true;
-
-						// save its coords
-						for (int i = 0; i < 3; i++)
-							triangle->vertices[i] = vertnorms[values[i]];
-						for (int i = 0; i < 3; i++)
-							triangle->vertexnorms[i] = norms[i + 3];
+						{
+							found = found && values[i] >= 0.0f && values[i] < num_verts && values[i] == std::floor(values[i]);
+						}
 
-						// save material properties
-						triangle->diffuse = glm::vec3(diffuse[0], diffuse[1], diffuse[2]);
-						triangle->specular = glm::vec3(specular[0], specular[1], specular[2]);
-						triangle->emission = glm::vec3(emission[0], emission[1], emission[2]);
-						triangle->ambient = glm::vec3(ambient[0], ambient[1], ambient[2]);
-						triangle->shininess = shininess;
+						if (!found)
+						{
+							cout << "Vertex index out of range, will skip\n";
+						}
+						else if (current_shape < 0 && animstack.back() >= 0)
+						{
+							cout << "Triangles under an animated transform must be in an instanced mesh, will skip\n";
+						}
+						else
+						{
+							const glm::mat4 &M = transfstack.top();
+							Mesh &target = current_shape < 0 ? mesh : shapes[current_shape].mesh;
+							uint32_t ids[3];
+							for (int i = 0; i < 3; i++)
+							{
+								meshVertex((int)values[i], with_normal, M, target, ids[i]);
+							}
 
-						// save transormation matrix
-						triangle->trans = transfstack.top();
-						triangle->inv_trans = glm::inverse(triangle->trans);
+							// a mirroring transform flips the winding, swap two vertices
+							// to keep the normal facing the way it does in object space
+							if (glm::determinant(glm::mat3(M)) < 0.0f)
+								std::swap(ids[1], ids[2]);
 
-						objects.push_back(triangle);
+							// save material properties
+							target.addTriangle(ids[0], ids[1], ids[2], currentMaterial());
+						}
 					}
+					break;
 				}
 				//----------------------------------------------------------
 				//
 				//--------THE FOLLOWING PARSES TRANSORMATIONS---------------
 
-				else if (cmd == "translate")
+				case Command::translate:
 				{
 					validinput = readvals(s, 3, values);
 					if (validinput)
 					{
 						rightmultiply(Transform::translate(values[0], values[1], values[2]), transfstack);
 					}
+					break;
 				}
-				else if (cmd == "scale")
+				case Command::scale:
 				{
 					validinput = readvals(s, 3, values);
 					if (validinput)
 					{
 						rightmultiply(Transform::scale(values[0], values[1], values[2]), transfstack);
 					}
+					break;
 				}
-				else if (cmd == "rotate")
+				case Command::rotate:
 				{
 					validinput = readvals(s, 4, values);
 					if (validinput)
@@ -273,27 +509,194 @@ void Scene::readfile(const char *filename)
 						glm::mat4 rot4 = glm::mat4(rot);
 						rightmultiply(rot4, transfstack);
 					}
+					break;
 				}
-				else if (cmd == "pushTransform")
+				case Command::pushTransform:
 				{
 					transfstack.push(transfstack.top());
+					animstack.push_back(animstack.back());
+					break;
 				}
-				else if (cmd == "popTransform")
+				case Command::popTransform:
 				{
-					if (transfstack.size() <= 1)
+					// a mesh declaration cannot pop the transforms it is placed under
+					if (transfstack.size() <= 1 || (current_shape >= 0 && transfstack.size() <= shape_stack_size + 1))
 					{
 						cerr << "Stack has no elements.  Cannot Pop\n";
 					}
 					else
 					{
 						transfstack.pop();
+						animstack.pop_back();
+						transform_epoch++;
 					}
+					break;
+				}
+
+				//-----------------------------------------------------------
+				//
+				//--------THE FOLLOWING PARSES INSTANCING--------------------
+				//
+				// beginMesh name ... endMesh declares a named mesh from the
+				// triangles and spheres in between, in its own space: the
+				// transforms in effect at beginMesh do not apply to it.
+				// instance name places it under the current transform
+				case Command::beginMesh:
+				{
+					std::string_view name;
+					if (!s.next(name))
+					{
+						cout << "Failed reading value, will skip\n";
+					}
+					else if (current_shape >= 0)
+					{
+						cout << "Meshes cannot be nested, will skip\n";
+					}
+					else if (shape_ids.find(name) != shape_ids.end())
+					{
+						cout << "Mesh " << name << " is already defined, will skip\n";
+					}
+					else
+					{
+						current_shape = shapes.size();
+						shapes.push_back(Shape());
+						shape_ids[std::string(name)] = current_shape;
+
+						shape_stack_size = transfstack.size();
+						transfstack.push(glm::mat4(1.0));
+						animstack.push_back(-1);
+						transform_epoch++;
+					}
+					break;
+				}
+				case Command::endMesh:
+				{
+					if (current_shape < 0)
+					{
+						cout << "endMesh without beginMesh, will skip\n";
+					}
+					else
+					{
+						while (transfstack.size() > shape_stack_size)
+							transfstack.pop();
+						animstack.resize(shape_stack_size);
+						current_shape = -1;
+						transform_epoch++;
+					}
+					break;
+				}
+				case Command::instance:
+				{
+					std::string_view name;
+					if (!s.next(name))
+					{
+						cout << "Failed reading value, will skip\n";
+					}
+					else if (current_shape >= 0)
+					{
+						cout << "Instances cannot be placed inside a mesh, will skip\n";
+					}
+					else
+					{
+						auto found = shape_ids.find(name);
+						if (found == shape_ids.end())
+						{
+							cout << "Unknown mesh " << name << ", will skip\n";
+						}
+						else if (!shapes[found->second].empty())
+						{
+							addInstance(found->second, transfstack.top(), animstack.back());
+						}
+					}
+					break;
+				}
+
+				//-----------------------------------------------------------
+				//
+				//--------THE FOLLOWING PARSES KEYFRAMES--------------------
+				//
+				// cameraKey frame eye center up fovy is the camera at frame.
+				// transformKey frame translation axis degrees scale is a
+				// transform that moves over the frames. its first key starts
+				// an animation at the current level of the transform stack,
+				// the transform commands after it apply under it, and the
+				// popTransform of the level ends it. the instances placed
+				// in between move with it. keys come in frame order
+				case Command::cameraKey:
+				{
+					validinput = readvals(s, 11, values);
+					if (!validinput)
+						break;
+					if (!camera_keys.empty() && (int)values[0] <= camera_keys.back().frame)
+					{
+						cout << "Keys must be in frame order, will skip\n";
+						break;
+					}
+
+					CameraKey key;
+					key.frame = (int)values[0];
+					for (int i = 0; i < 3; i++)
+					{
+						key.eye[i] = values[i + 1];
+						key.center[i] = values[i + 4];
+						key.up[i] = values[i + 7];
+					}
+					key.fovy = values[10];
+					camera_keys.push_back(key);
+					break;
+				}
+				case Command::transformKey:
+				{
+					validinput = readvals(s, 11, values);
+					if (!validinput)
+						break;
+
+					int animation = animstack.back();
+					glm::vec3 axis(values[4], values[5], values[6]);
+					if (current_shape >= 0)
+					{
+						cout << "Transforms inside a mesh cannot be animated, will skip\n";
+					}
+					else if (animation >= 0 && animstack.size() > 1 && animstack[animstack.size() - 2] == animation)
+					{
+						cout << "Animated transforms cannot be nested, will skip\n";
+					}
+					else if (animation >= 0 && (int)values[0] <= transform_keys.back().frame)
+					{
+						cout << "Keys must be in frame order, will skip\n";
+					}
+					else if (glm::dot(axis, axis) == 0.0f)
+					{
+						cout << "Rotation axis cannot be zero, will skip\n";
+					}
+					else
+					{
+						TransformKey key;
+						key.frame = (int)values[0];
+						key.translation = glm::vec3(values[1], values[2], values[3]);
+						key.rotation = glm::angleAxis(glm::radians(values[7]), glm::normalize(axis));
+						key.scale = glm::vec3(values[8], values[9], values[10]);
+
+						// the transforms so far become the parent of the
+						// animation, the ones after it its local transforms
+						if (animation < 0)
+						{
+							Animation started = {transfstack.top(), (int)transform_keys.size(), 0};
+							animations.push_back(started);
+							animation = animstack.back() = animations.size() - 1;
+							transfstack.top() = glm::mat4(1.0);
+							transform_epoch++;
+						}
+						transform_keys.push_back(key);
+						animations[animation].keys++;
+					}
+					break;
 				}
 
 				//-----------------------------------------------------------
 				//
 				//--------THE FOLLOWING PARSES LIGHTS------------------------
-				else if (cmd == "directional")
+				case Command::directional:
 				{
 					validinput = readvals(s, 6, values); // directional (x,y,z,r,g,b)
 					if (validinput)
@@ -308,8 +711,9 @@ void Scene::readfile(const char *filename)
 
 						lights.push_back(light);
 					}
+					break;
 				}
-				else if (cmd == "point")
+				case Command::point:
 				{
 					validinput = readvals(s, 6, values); // point (x,y,z,r,g,b)
 					if (validinput)
@@ -324,8 +728,9 @@ void Scene::readfile(const char *filename)
 
 						lights.push_back(light);
 					}
+					break;
 				}
-				else if (cmd == "attenuation")
+				case Command::attenuation:
 				{
 					validinput = readvals(s, 3, values); // attenuation (const, lin, quadr)
 					if (validinput)
@@ -335,11 +740,12 @@ void Scene::readfile(const char *filename)
 							attenuation[i] = values[i];
 						}
 					}
+					break;
 				}
 				//------------------------------------------------------------
 				//
 				//-------THE FOLLOWING PARSES MATERIAL PROPERTIES-------------
-				else if (cmd == "ambient")
+				case Command::ambient:
 				{
 					validinput = readvals(s, 3, values); // ambient (r,g,b)
 					if (validinput)
@@ -349,8 +755,9 @@ void Scene::readfile(const char *filename)
 							ambient[i] = values[i];
 						}
 					}
+					break;
 				}
-				else if (cmd == "diffuse")
+				case Command::diffuse:
 				{
 					validinput = readvals(s, 3, values);
 					if (validinput)
@@ -360,8 +767,9 @@ void Scene::readfile(const char *filename)
 							diffuse[i] = values[i];
 						}
 					}
+					break;
 				}
-				else if (cmd == "specular")
+				case Command::specular:
 				{
 					validinput = readvals(s, 3, values);
 					if (validinput)
@@ -371,8 +779,9 @@ void Scene::readfile(const char *filename)
 							specular[i] = values[i];
 						}
 					}
+					break;
 				}
-				else if (cmd == "emission")
+				case Command::emission:
 				{
 					validinput = readvals(s, 3, values);
 					if (validinput)
@@ -382,25 +791,38 @@ void Scene::readfile(const char *filename)
 							emission[i] = values[i];
 						}
 					}
+					break;
 				}
-				else if (cmd == "shininess")
+				case Command::shininess:
 				{
 					validinput = readvals(s, 1, values);
 					if (validinput)
 					{
 						shininess = values[0];
 					}
+					break;
 				}
 				//-----------------------------------------------------------------
 				//
 				//
-				else
+				default:
 				{
 					cerr << "Unknown Command: " << cmd << " Skipping \n";
+					break;
+				}
 				}
 			}
-			getline(in, str);
 		}
+
+		// the meshes hold everything needed from the parsed vertices
+		current_shape = -1;
+		std::vector<glm::vec3>().swap(vertices);
+		std::vector<glm::vec3>().swap(vertnorms);
+		std::vector<glm::vec3>().swap(norms);
+		std::vector<uint32_t>().swap(vertex_ids);
+		std::vector<uint32_t>().swap(vertnorm_ids);
+		std::vector<int>().swap(vertex_epochs);
+		std::vector<int>().swap(vertnorm_epochs);
 	}
 	else
 	{
@@ -408,3 +830,30 @@ void Scene::readfile(const char *filename)
 		throw 2;
 	}
 }
+
+void Scene::buildBVH(const BVH::Options &options, int num_threads)
+{
+	for (Shape &shape : shapes)
+		shape.bvh.build(shape.mesh, shape.spheres, std::vector<Instance>(), options, num_threads);
+
+	// instances are bounded by the bounds of their shape's BVH
+	for (Instance &instance : instances)
+		instance.bounds = instance.transformBounds(shapes[instance.shape].bvh.bounds());
+
+	bvh.build(mesh, spheres, instances, options, num_threads);
+}
+
+bool Scene::updateBVH(const std::vector<int> &moved, const BVH::Options &options, int num_threads)
+{
+	int first_instance = mesh.size() + spheres.size();
+	for (int p : moved)
+		if (p >= first_instance) {
+			Instance &instance = instances[p - first_instance];
+			instance.bounds = instance.transformBounds(shapes[instance.shape].bvh.bounds());
+		}
+
+	if (bvh.refit(mesh, spheres, instances, moved) <= options.max_refit_cost)
+		return false;
+	bvh.build(mesh, spheres, instances, options, num_threads);
+	return true;
+}
@@ -1,18 +1,19 @@
 //header file for camera
 
+#include <array>
+#include <map>
 #include <vector>
 #include <stack>
-#include <fstream>
-#include <sstream>
 #include <iostream>
 #include <string>
+#include <string_view>
 
 #include "geometry.h"
+#include "bvh.h"
+#include "animation.h"
 
 using namespace std;
 
-const float epsilon = 1e-4;
-
 class Camera {
 	public:
 		glm::vec3 eye, center, up;
@@ -23,26 +24,101 @@ class Camera {
 		Camera();
 };
 
+//a camera rendered to its own output file, declared by a camera line
+//that ends with the file name
+class View {
+	public:
+		Camera cam;
+		std::string outfilename;
+};
+
 // To be used when camera configuration is passed
 
 
 
+// one line of the scene file, split into whitespace separated tokens in
+// place. replaces the stringstream the parser used to build per line
+class LineTokens {
+	public:
+		const char* p;
+		const char* end;
+
+		LineTokens(const char* begin, const char* end) : p(begin), end(end) {}
+
+		bool next(std::string_view& token); // false at the end of the line
+		bool next(float& value); // false if the next token is not a number
+};
+
+//geometry stored once in its own space and placed in the world by
+//instances: a mesh declared with beginMesh ... endMesh, or a sphere under
+//a transform that does not keep it round
+class Shape {
+	public:
+		Mesh mesh;
+		std::vector<Sphere> spheres;
+		BVH bvh; //bottom level, over the primitives of the shape in its space
+
+		bool empty() const { return mesh.size() == 0 && spheres.empty(); }
+};
+
 class Scene {
 	public:
 		Camera cam;
+		std::vector<View> views; //if there are any, they are rendered instead of cam
 		std::vector<Light> lights;
-		std::vector<glm::vec3> vertices;
-		std::vector<Object*> objects; //holds pointers to all objects 
-
-		//for vertices with norms. one-to-one correspondence between indices.
-		std::vector<glm::vec3> vertnorms;
-		std::vector<glm::vec3> norms;
+		//world space primitives, one mesh for the triangles and an array of spheres
+		Mesh mesh;
+		std::vector<Sphere> spheres;
+		//instanced geometry, each shape stored once however often it is placed
+		std::vector<Shape> shapes;
+		std::vector<Instance> instances;
+		std::vector<Material> materials; //deduplicated, shared by the primitives
+		BVH bvh; //top level, over the world space primitives and the instances
+		//keyframes, empty for a still scene
+		std::vector<CameraKey> camera_keys;
+		std::vector<TransformKey> transform_keys; //of every animation
+		std::vector<Animation> animations;
+		std::vector<AnimatedInstance> animated_instances;
 
 		glm::vec3 attenuation = glm::vec3(1.0f, 0.0f, 0.0f);
 
 		void rightmultiply(const glm::mat4 & M, stack<glm::mat4> &transfstack);
-		bool readvals(stringstream &s, const int numvals, float* values); 
+		bool readvals(LineTokens &s, const int numvals, float* values); 
 		void readfile(const char* filename);
+		int currentMaterial();
+		int sphereShape(const Sphere &sphere);
+		void addInstance(int shape, const glm::mat4 &M, int animation);
+		bool meshVertex(int v, bool with_normal, const glm::mat4 &M, Mesh &target, uint32_t &id);
+
+		// build the BVH of every shape, then the top level one. a BVH
+		// loaded with the scene or from the cache needs no build
+		void buildBVH(const BVH::Options &options = BVH::Options(), int num_threads = 0);
+
+		// bring the top level BVH up to date after the world space
+		// primitives or instance transforms in moved (BVH primitive numbers)
+		// changed. refits it, or rebuilds it once the refit SAH cost passes
+		// options.max_refit_cost. true if it was rebuilt
+		bool updateBVH(const std::vector<int> &moved, const BVH::Options &options = BVH::Options(), int num_threads = 0);
+
+		// Animation (animation.cpp). the frames from the first key to the
+		// last, false for a still scene. camera keys count only for a
+		// scene without views, which they do not move
+		bool frameRange(int &first, int &last) const;
+		// move the camera and the animated instances to frame. appends the
+		// BVH primitive numbers of the instances that moved, for updateBVH
+		void setFrame(int frame, std::vector<int> &moved);
+
+		// Compiled binary scenes (scenefile.cpp), loaded without parsing.
+		// load also restores the BVH if it was saved with the scene
+		bool save(const char* filename, bool with_bvh) const;
+		bool load(const char* filename);
+		static bool isCompiled(const char* filename);
+
+		// BVH cache files (scenefile.cpp). a BVH is saved with the hash of
+		// the geometry and options it was built for, and loads only for the same hash
+		uint64_t geometryHash(const BVH::Options &options) const;
+		bool saveBVH(const char* filename, uint64_t hash, double build_seconds) const;
+		bool loadBVH(const char* filename, uint64_t hash, double& build_seconds);
 
 		// The following are temporary storage variables for parsing
 		int width = 256;
@@ -55,11 +131,30 @@ class Scene {
 
 		// Materials (read from file) 
 		// With multiple objects, these are colors for each.
-		float ambient[3] ; 
-		float diffuse[3] ; 
-		float specular[3] ; 
-		float emission[3] ; 
+		float ambient[3] = {0.2f, 0.2f, 0.2f}; 
+		float diffuse[3] = {0.0f, 0.0f, 0.0f}; 
+		float specular[3] = {0.0f, 0.0f, 0.0f}; 
+		float emission[3] = {0.0f, 0.0f, 0.0f}; 
 		float shininess = 0; 
+		std::map<std::array<float, 13>, int> material_ids; // material table lookup
+
+		// Shapes by mesh name, and the shapes of instanced spheres by
+		// center, radius and material
+		std::map<std::string, int, std::less<>> shape_ids;
+		std::map<std::array<float, 5>, int> sphere_shape_ids;
+		int current_shape = -1; // the mesh being declared, -1 outside of beginMesh ... endMesh
+		size_t shape_stack_size; // transform stack size at its beginMesh
+
+		// Vertices as read, in object space. They are only kept while
+		// parsing; the mesh stores each one once per transform it is used
+		// under, and ids/epochs remember where. The epoch also changes
+		// when triangles start going to another mesh.
+		std::vector<glm::vec3> vertices;
+		std::vector<glm::vec3> vertnorms; //for vertices with norms. one-to-one correspondence between indices.
+		std::vector<glm::vec3> norms;
+		std::vector<uint32_t> vertex_ids, vertnorm_ids; //mesh index of each vertex
+		std::vector<int> vertex_epochs, vertnorm_epochs; //transform epoch of each mesh index
+		int transform_epoch = 0; //bumped whenever the current transform changes
 
 		int maxverts; //max number of vertices for a triangle
 		int maxvertnorms; //max number of vertices with normals
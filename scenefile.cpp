@@ -0,0 +1,600 @@
+// compiled binary scenes, written by "raytrace compile", and BVH cache
+// files. a file is a header with a table of sections, followed by the
+// sections. every section is an array of one of the in memory types,
+// stored as it is and aligned to 64 bytes, so loading is one copy per
+// array and no parsing. the layout therefore depends on the build: the
+// version and the element size of every section are checked before
+// anything is read.
+// the world geometry and the shapes each have a mesh, spheres and a BVH.
+// their arrays of one type share a section, the world's first and then
+// every shape's, and a table section holds the size of every part
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+
+#include <unistd.h>
+
+#include "scene.h"
+#include "mappedfile.h"
+
+static const char scene_magic[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+static const uint32_t scene_version = 5;
+static const char bvh_magic[8] = {'R', 'T', 'B', 'V', 'H', '\0', '\0', '\0'};
+static const uint32_t bvh_version = 3;
+static const uint64_t section_alignment = 64;
+
+enum Section
+{
+    settings_section,
+    output_section, // outfilename characters
+    light_section,
+    material_section,
+    position_section,
+    normal_section,
+    index_section,
+    triangle_material_section,
+    sphere_section,
+    node_section, // the BVH sections are empty if it was not saved
+    quantized_node_section,
+    leaf_section,
+    primitive_section,
+    block_section,
+    shape_section, // ShapeEntry of the world and of every shape
+    instance_section,
+    camera_key_section,
+    transform_key_section,
+    animation_section,
+    animated_instance_section,
+    view_section, // the camera of every view
+    view_output_section, // the outfilename of every view, each ended by a 0
+    num_sections
+};
+
+class SectionEntry
+{
+public:
+    uint64_t offset;
+    uint64_t count;
+    uint64_t element_size;
+};
+
+class SceneHeader
+{
+public:
+    char magic[8];
+    uint32_t version;
+    uint32_t has_bvh;
+    SectionEntry sections[num_sections];
+};
+
+enum BVHSection
+{
+    bvh_node_section,
+    bvh_quantized_node_section,
+    bvh_leaf_section,
+    bvh_primitive_section,
+    bvh_block_section,
+    bvh_table_section, // BVHEntry of the world and of every shape
+    num_bvh_sections
+};
+
+// sizes of the parts of one BVH and of one mesh with its spheres
+class BVHEntry
+{
+public:
+    uint64_t nodes;
+    uint64_t quantized_nodes;
+    uint64_t leaves;
+    uint64_t primitives;
+    uint64_t blocks;
+};
+
+class ShapeEntry
+{
+public:
+    uint64_t positions;
+    uint64_t normals;
+    uint64_t triangles;
+    uint64_t spheres;
+    BVHEntry bvh; // zero if the BVH was not saved
+};
+
+class BVHHeader
+{
+public:
+    char magic[8];
+    uint32_t version;
+    int32_t num_triangles;
+    uint64_t hash; // Scene::geometryHash of the geometry it was built for
+    double build_seconds;
+    SectionEntry sections[num_bvh_sections];
+};
+
+// everything of the scene that is not an array
+class SceneSettings
+{
+public:
+    Camera cam;
+    glm::vec3 attenuation;
+    int32_t width, height, depth;
+};
+
+static uint64_t alignSection(uint64_t offset)
+{
+    return (offset + section_alignment - 1) / section_alignment * section_alignment;
+}
+
+bool Scene::isCompiled(const char *filename)
+{
+    char magic[sizeof(scene_magic)];
+    std::ifstream in(filename, std::ios::binary);
+    return in.read(magic, sizeof(magic)) && memcmp(magic, scene_magic, sizeof(magic)) == 0;
+}
+
+// fill in the section offsets of a file with the given header size
+static void layoutSections(SectionEntry *sections, int num, size_t header_size)
+{
+    uint64_t offset = alignSection(header_size);
+    for (int s = 0; s < num; s++)
+    {
+        sections[s].offset = offset;
+        offset = alignSection(offset + sections[s].count * sections[s].element_size);
+    }
+}
+
+// the arrays a section is written from, one after the other: their
+// data and size in bytes
+typedef std::vector<std::pair<const void *, uint64_t>> SectionParts;
+
+// write the header and the sections. the file is written under a temporary
+// name and renamed, so a concurrent reader never sees half of it
+static bool writeSections(const char *filename, const void *header, size_t header_size,
+                          const SectionEntry *sections, const SectionParts *parts, int num)
+{
+    std::string temporary = std::string(filename) + ".tmp" + std::to_string(getpid());
+    std::ofstream out(temporary, std::ios::binary);
+    out.write((const char *)header, header_size);
+    uint64_t position = header_size;
+    for (int s = 0; s < num; s++)
+    {
+        static const char padding[section_alignment] = {};
+        out.write(padding, sections[s].offset - position);
+        for (const std::pair<const void *, uint64_t> &part : parts[s])
+            out.write((const char *)part.first, part.second);
+        position = sections[s].offset + sections[s].count * sections[s].element_size;
+    }
+    out.close();
+
+    if (!out || rename(temporary.c_str(), filename) != 0)
+    {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+// append the array v to a section
+template <class T>
+static void setSection(SectionEntry &entry, SectionParts &parts, const std::vector<T> &v)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "sections are copied as raw bytes");
+    parts.push_back(std::make_pair((const void *)v.data(), v.size() * sizeof(T)));
+    entry.count += v.size();
+    entry.element_size = sizeof(T);
+}
+
+// append a BVH to the five BVH sections (nodes to blocks) starting at sections
+static BVHEntry addBVH(SectionEntry *sections, SectionParts *parts, const BVH &bvh)
+{
+    setSection(sections[0], parts[0], bvh.nodes);
+    setSection(sections[1], parts[1], bvh.quantized_nodes);
+    setSection(sections[2], parts[2], bvh.leaves);
+    setSection(sections[3], parts[3], bvh.indices);
+    setSection(sections[4], parts[4], bvh.blocks);
+    return {bvh.nodes.size(), bvh.quantized_nodes.size(), bvh.leaves.size(), bvh.indices.size(), bvh.blocks.size()};
+}
+
+// append the world geometry or a shape to the sections of a scene
+static ShapeEntry addGeometry(SectionEntry *sections, SectionParts *parts, const Mesh &mesh,
+                              const std::vector<Sphere> &spheres, const BVH &bvh, bool with_bvh)
+{
+    setSection(sections[position_section], parts[position_section], mesh.positions);
+    setSection(sections[normal_section], parts[normal_section], mesh.normals);
+    setSection(sections[index_section], parts[index_section], mesh.indices);
+    setSection(sections[triangle_material_section], parts[triangle_material_section], mesh.materials);
+    setSection(sections[sphere_section], parts[sphere_section], spheres);
+
+    ShapeEntry entry = {mesh.positions.size(), mesh.normals.size(), mesh.size(), spheres.size(), {0, 0, 0, 0, 0}};
+    if (with_bvh)
+        entry.bvh = addBVH(sections + node_section, parts + node_section, bvh);
+    return entry;
+}
+
+bool Scene::save(const char *filename, bool with_bvh) const
+{
+    SceneSettings settings;
+    settings.cam = cam;
+    settings.attenuation = attenuation;
+    settings.width = width;
+    settings.height = height;
+    settings.depth = depth;
+
+    SectionParts parts[num_sections];
+    SceneHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, scene_magic, sizeof(scene_magic));
+    header.version = scene_version;
+    header.has_bvh = with_bvh;
+
+    SectionEntry *sections = header.sections;
+    parts[settings_section].push_back(std::make_pair((const void *)&settings, sizeof(settings)));
+    sections[settings_section].count = 1;
+    sections[settings_section].element_size = sizeof(settings);
+    parts[output_section].push_back(std::make_pair((const void *)outfilename.data(), outfilename.size()));
+    sections[output_section].count = outfilename.size();
+    sections[output_section].element_size = 1;
+    setSection(sections[light_section], parts[light_section], lights);
+    setSection(sections[material_section], parts[material_section], materials);
+    setSection(sections[instance_section], parts[instance_section], instances);
+    setSection(sections[camera_key_section], parts[camera_key_section], camera_keys);
+    setSection(sections[transform_key_section], parts[transform_key_section], transform_keys);
+    setSection(sections[animation_section], parts[animation_section], animations);
+    setSection(sections[animated_instance_section], parts[animated_instance_section], animated_instances);
+
+    std::vector<Camera> view_cameras;
+    std::vector<char> view_outputs;
+    for (const View &view : views)
+    {
+        view_cameras.push_back(view.cam);
+        view_outputs.insert(view_outputs.end(), view.outfilename.begin(), view.outfilename.end());
+        view_outputs.push_back('\0');
+    }
+    setSection(sections[view_section], parts[view_section], view_cameras);
+    setSection(sections[view_output_section], parts[view_output_section], view_outputs);
+    sections[node_section].element_size = sizeof(WideNode);
+    sections[quantized_node_section].element_size = sizeof(QuantizedNode);
+    sections[leaf_section].element_size = sizeof(BVHLeaf);
+    sections[primitive_section].element_size = sizeof(int);
+    sections[block_section].element_size = sizeof(TriBlock);
+
+    std::vector<ShapeEntry> table;
+    table.push_back(addGeometry(sections, parts, mesh, spheres, bvh, with_bvh));
+    for (const Shape &shape : shapes)
+        table.push_back(addGeometry(sections, parts, shape.mesh, shape.spheres, shape.bvh, with_bvh));
+    setSection(sections[shape_section], parts[shape_section], table);
+
+    layoutSections(sections, num_sections, sizeof(header));
+    if (!writeSections(filename, &header, sizeof(header), sections, parts, num_sections))
+    {
+        cerr << "Unable to write compiled scene " << filename << "\n";
+        return false;
+    }
+    return true;
+}
+
+// the contents of a section, or nullptr if it does not hold elements of
+// element_size or does not fit into the file
+static const char *sectionData(const MappedFile &file, const SectionEntry &entry, size_t element_size)
+{
+    if (entry.element_size != element_size || entry.offset > file.size() ||
+        entry.count > (file.size() - entry.offset) / element_size)
+        return nullptr;
+    return file.data() + entry.offset;
+}
+
+template <class T>
+static bool readSection(const MappedFile &file, const SectionEntry &entry, std::vector<T> &v)
+{
+    const T *data = (const T *)sectionData(file, entry, sizeof(T));
+    if (!data)
+        return false;
+    v.assign(data, data + entry.count);
+    return true;
+}
+
+// reads the parts of a section one after the other
+template <class T>
+class SectionReader
+{
+public:
+    const T *data;
+    uint64_t left;
+
+    SectionReader(const MappedFile &file, const SectionEntry &entry)
+        : data((const T *)sectionData(file, entry, sizeof(T))), left(data ? entry.count : 0) {}
+
+    // the next count elements. false if the section is invalid or has fewer
+    bool read(uint64_t count, std::vector<T> &v)
+    {
+        if (!data || count > left)
+            return false;
+        v.assign(data, data + count);
+        data += count;
+        left -= count;
+        return true;
+    }
+};
+
+// reads BVHs from the five BVH sections starting at sections
+class BVHReader
+{
+public:
+    SectionReader<WideNode> nodes;
+    SectionReader<QuantizedNode> quantized_nodes;
+    SectionReader<BVHLeaf> leaves;
+    SectionReader<int> primitives;
+    SectionReader<TriBlock> blocks;
+
+    BVHReader(const MappedFile &file, const SectionEntry *sections)
+        : nodes(file, sections[0]), quantized_nodes(file, sections[1]), leaves(file, sections[2]),
+          primitives(file, sections[3]), blocks(file, sections[4]) {}
+
+    // the primitive counts are those of the geometry the BVH is for
+    bool read(const BVHEntry &entry, BVH &bvh, int num_triangles, int num_spheres)
+    {
+        bvh = BVH(); // also drops what refit kept for a BVH loaded over it
+        if (!nodes.read(entry.nodes, bvh.nodes) || !quantized_nodes.read(entry.quantized_nodes, bvh.quantized_nodes) ||
+            !leaves.read(entry.leaves, bvh.leaves) || !primitives.read(entry.primitives, bvh.indices) ||
+            !blocks.read(entry.blocks, bvh.blocks))
+            return false;
+        bvh.num_triangles = bvh.empty() ? 0 : num_triangles;
+        bvh.num_spheres = bvh.empty() ? 0 : num_spheres;
+        return true;
+    }
+
+    bool done() const
+    {
+        return nodes.left == 0 && quantized_nodes.left == 0 && leaves.left == 0 && primitives.left == 0 &&
+               blocks.left == 0;
+    }
+};
+
+// reads the world geometry and then every shape from the sections of a scene
+class GeometryReader
+{
+public:
+    SectionReader<glm::vec3> positions;
+    SectionReader<glm::vec3> normals;
+    SectionReader<uint32_t> indices;
+    SectionReader<int> materials;
+    SectionReader<Sphere> spheres;
+    BVHReader bvh;
+
+    GeometryReader(const MappedFile &file, const SectionEntry *sections)
+        : positions(file, sections[position_section]), normals(file, sections[normal_section]),
+          indices(file, sections[index_section]), materials(file, sections[triangle_material_section]),
+          spheres(file, sections[sphere_section]), bvh(file, sections + node_section) {}
+
+    bool read(const ShapeEntry &entry, Mesh &mesh, std::vector<Sphere> &sphere_list, BVH &shape_bvh)
+    {
+        return entry.triangles <= indices.left / 3 &&
+               positions.read(entry.positions, mesh.positions) && normals.read(entry.normals, mesh.normals) &&
+               indices.read(3 * entry.triangles, mesh.indices) && materials.read(entry.triangles, mesh.materials) &&
+               spheres.read(entry.spheres, sphere_list) &&
+               bvh.read(entry.bvh, shape_bvh, mesh.size(), sphere_list.size());
+    }
+
+    bool done() const
+    {
+        return positions.left == 0 && normals.left == 0 && indices.left == 0 && materials.left == 0 &&
+               spheres.left == 0 && bvh.done();
+    }
+};
+
+bool Scene::load(const char *filename)
+{
+    MappedFile file;
+    if (!file.open(filename))
+    {
+        cerr << "Unable to Open Input Data File " << filename << "\n";
+        return false;
+    }
+
+    SceneHeader header;
+    if (file.size() < sizeof(header))
+    {
+        cerr << "Truncated compiled scene " << filename << "\n";
+        return false;
+    }
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, scene_magic, sizeof(scene_magic)) != 0 || header.version != scene_version)
+    {
+        cerr << "Compiled scene " << filename << " is not of version " << scene_version << ", compile it again\n";
+        return false;
+    }
+
+    const SceneSettings *settings = (const SceneSettings *)sectionData(file, header.sections[settings_section], sizeof(SceneSettings));
+    const char *output = sectionData(file, header.sections[output_section], 1);
+    std::vector<ShapeEntry> table;
+    std::vector<Camera> view_cameras;
+    std::vector<char> view_outputs;
+    bool valid = settings && header.sections[settings_section].count == 1 && output &&
+                 readSection(file, header.sections[light_section], lights) &&
+                 readSection(file, header.sections[material_section], materials) &&
+                 readSection(file, header.sections[instance_section], instances) &&
+                 readSection(file, header.sections[camera_key_section], camera_keys) &&
+                 readSection(file, header.sections[transform_key_section], transform_keys) &&
+                 readSection(file, header.sections[animation_section], animations) &&
+                 readSection(file, header.sections[animated_instance_section], animated_instances) &&
+                 readSection(file, header.sections[view_section], view_cameras) &&
+                 readSection(file, header.sections[view_output_section], view_outputs) &&
+                 (view_outputs.empty() || view_outputs.back() == '\0') &&
+                 std::count(view_outputs.begin(), view_outputs.end(), '\0') == (long)view_cameras.size() &&
+                 readSection(file, header.sections[shape_section], table) && !table.empty();
+    if (valid)
+    {
+        GeometryReader reader(file, header.sections);
+        valid = reader.read(table[0], mesh, spheres, bvh);
+        shapes.resize(table.size() - 1);
+        for (size_t i = 0; valid && i < shapes.size(); i++)
+            valid = reader.read(table[i + 1], shapes[i].mesh, shapes[i].spheres, shapes[i].bvh);
+        valid = valid && reader.done();
+        for (const Instance &instance : instances)
+            valid = valid && instance.shape >= 0 && instance.shape < (int)shapes.size();
+        for (const Animation &animation : animations)
+            valid = valid && animation.keys > 0 && animation.first_key >= 0 &&
+                    animation.first_key <= (int)transform_keys.size() - animation.keys;
+        for (const AnimatedInstance &animated : animated_instances)
+            valid = valid && animated.instance >= 0 && animated.instance < (int)instances.size() &&
+                    animated.animation >= 0 && animated.animation < (int)animations.size();
+    }
+    if (!valid)
+    {
+        cerr << "Compiled scene " << filename << " is damaged or does not match this build, compile it again\n";
+        return false;
+    }
+
+    cam = settings->cam;
+    attenuation = settings->attenuation;
+    width = settings->width;
+    height = settings->height;
+    depth = settings->depth;
+    outfilename.assign(output, header.sections[output_section].count);
+
+    views.resize(view_cameras.size());
+    const char *name = view_outputs.data();
+    for (size_t i = 0; i < views.size(); i++)
+    {
+        views[i].cam = view_cameras[i];
+        views[i].outfilename = name;
+        name += views[i].outfilename.size() + 1;
+    }
+    return true;
+}
+
+// 64-bit hash over words of raw data. not cryptographic, only meant to
+// tell different geometry apart
+class Hasher
+{
+public:
+    uint64_t hash = 0x9e3779b97f4a7c15ull;
+
+    void add(const void *data, size_t bytes)
+    {
+        const char *p = (const char *)data;
+        for (; bytes >= 8; bytes -= 8, p += 8)
+        {
+            uint64_t word;
+            memcpy(&word, p, 8);
+            mix(word);
+        }
+        uint64_t tail = 0;
+        memcpy(&tail, p, bytes);
+        mix(tail ^ (uint64_t)bytes << 56);
+    }
+
+    template <class T>
+    void add(const std::vector<T> &v)
+    {
+        add(v.data(), v.size() * sizeof(T));
+    }
+
+private:
+    void mix(uint64_t word)
+    {
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+    }
+};
+
+// the triangles and spheres of a mesh, the spheres field by field to
+// leave out their materials
+static void hashGeometry(Hasher &hasher, const Mesh &mesh, const std::vector<Sphere> &spheres)
+{
+    hasher.add(mesh.positions);
+    hasher.add(mesh.indices);
+    uint64_t num_spheres = spheres.size();
+    hasher.add(&num_spheres, sizeof(num_spheres));
+    for (const Sphere &sphere : spheres)
+    {
+        hasher.add(&sphere.center, sizeof(sphere.center));
+        hasher.add(&sphere.radius, sizeof(sphere.radius));
+    }
+}
+
+// everything the BVHs are built from: the world space geometry, the
+// geometry of every shape and where the instances place them. the build
+// options and the layout of the BVH types are included, a build with
+// other layouts misses
+uint64_t Scene::geometryHash(const BVH::Options &options) const
+{
+    Hasher hasher;
+    uint64_t layout[7] = {sizeof(WideNode), sizeof(QuantizedNode), sizeof(TriBlock), bvh_version,
+                          (uint64_t)options.method, (uint64_t)options.width, (uint64_t)options.quantize};
+    hasher.add(layout, sizeof(layout));
+    hasher.add(&options.split_budget, sizeof(options.split_budget));
+    hashGeometry(hasher, mesh, spheres);
+    for (const Shape &shape : shapes)
+        hashGeometry(hasher, shape.mesh, shape.spheres);
+    for (const Instance &instance : instances)
+    {
+        hasher.add(&instance.shape, sizeof(instance.shape));
+        hasher.add(&instance.trans, sizeof(instance.trans));
+    }
+    return hasher.hash;
+}
+
+bool Scene::saveBVH(const char *filename, uint64_t hash, double build_seconds) const
+{
+    BVHHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, bvh_magic, sizeof(bvh_magic));
+    header.version = bvh_version;
+    header.num_triangles = bvh.num_triangles;
+    header.hash = hash;
+    header.build_seconds = build_seconds;
+
+    SectionParts parts[num_bvh_sections];
+    std::vector<BVHEntry> table;
+    table.push_back(addBVH(header.sections, parts, bvh));
+    for (const Shape &shape : shapes)
+        table.push_back(addBVH(header.sections, parts, shape.bvh));
+    setSection(header.sections[bvh_table_section], parts[bvh_table_section], table);
+
+    layoutSections(header.sections, num_bvh_sections, sizeof(header));
+    return writeSections(filename, &header, sizeof(header), header.sections, parts, num_bvh_sections);
+}
+
+// quietly fails if there is no cache file, it is of another version or
+// layout, or it was built for other geometry
+bool Scene::loadBVH(const char *filename, uint64_t hash, double &build_seconds)
+{
+    MappedFile file;
+    BVHHeader header;
+    if (!file.open(filename) || file.size() < sizeof(header))
+        return false;
+
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, bvh_magic, sizeof(bvh_magic)) != 0 || header.version != bvh_version ||
+        header.hash != hash || header.num_triangles != (int)mesh.size())
+        return false;
+
+    std::vector<BVHEntry> table;
+    if (!readSection(file, header.sections[bvh_table_section], table) || table.size() != shapes.size() + 1)
+        return false;
+
+    // the world's BVH first, then every shape's
+    BVHReader reader(file, header.sections);
+    std::vector<BVH> cached(table.size());
+    if (!reader.read(table[0], cached[0], mesh.size(), spheres.size()))
+        return false;
+    for (size_t i = 0; i < shapes.size(); i++)
+        if (!reader.read(table[i + 1], cached[i + 1], shapes[i].mesh.size(), shapes[i].spheres.size()))
+            return false;
+    if (!reader.done())
+        return false;
+
+    bvh = std::move(cached[0]);
+    for (size_t i = 0; i < shapes.size(); i++)
+        shapes[i].bvh = std::move(cached[i + 1]);
+
+    // the instance bounds are not cached, but a refit reads them back for
+    // the instances that did not move, as buildBVH leaves them
+    for (Instance &instance : instances)
+        instance.bounds = instance.transformBounds(shapes[instance.shape].bvh.bounds());
+    build_seconds = header.build_seconds;
+    return true;
+}
@@ -0,0 +1,89 @@
+#include <algorithm>
+#include <thread>
+
+#include "scheduler.h"
+
+Scheduler::Scheduler(int num_threads) : num_threads(std::max(num_threads, 1))
+{
+    for (int i = 0; i < this->num_threads; i++)
+        workers.emplace_back(new Worker());
+}
+
+int Scheduler::hardwareThreads()
+{
+    return std::max((int)std::thread::hardware_concurrency(), 1);
+}
+
+void Scheduler::run(int num_jobs, const std::function<void(int job, int worker)> &job)
+{
+    // hand out contiguous ranges so neighbouring tiles stay on one thread
+    for (int w = 0; w < num_threads; w++)
+    {
+        int begin = (long long)num_jobs * w / num_threads;
+        int end = (long long)num_jobs * (w + 1) / num_threads;
+        for (int i = begin; i < end; i++)
+            workers[w]->jobs.push_back(i);
+    }
+
+    auto work = [&](int w) {
+        int index;
+        while (pop(w, index) || steal(w, index))
+            job(index, w);
+    };
+
+    if (num_threads == 1)
+    {
+        work(0);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    for (int w = 1; w < num_threads; w++)
+        threads.emplace_back(work, w);
+    work(0);
+    for (std::thread &t : threads)
+        t.join();
+}
+
+bool Scheduler::pop(int worker, int &job)
+{
+    Worker &self = *workers[worker];
+    std::lock_guard<std::mutex> guard(self.lock);
+    if (self.jobs.empty())
+        return false;
+    job = self.jobs.front();
+    self.jobs.pop_front();
+    return true;
+}
+
+// take one job from the back of the queue with the most jobs left. jobs are
+// never added while running, so once every queue is empty the work is done
+bool Scheduler::steal(int thief, int &job)
+{
+    while (true)
+    {
+        int victim = -1;
+        size_t most = 0;
+        for (int w = 0; w < num_threads; w++)
+        {
+            if (w == thief)
+                continue;
+            std::lock_guard<std::mutex> guard(workers[w]->lock);
+            if (workers[w]->jobs.size() > most)
+            {
+                most = workers[w]->jobs.size();
+                victim = w;
+            }
+        }
+        if (victim < 0)
+            return false;
+
+        Worker &other = *workers[victim];
+        std::lock_guard<std::mutex> guard(other.lock);
+        if (other.jobs.empty())
+            continue; // emptied in the meantime, look again
+        job = other.jobs.back();
+        other.jobs.pop_back();
+        return true;
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+//runs independent jobs on a pool of threads with work stealing.
+//every worker starts with a contiguous share of the jobs and takes them
+//from the front of its own queue; once that is empty it steals from the
+//back of the fullest other queue, so slow regions do not leave cores idle
+class Scheduler {
+	public:
+		explicit Scheduler(int num_threads);
+
+		int threads() const { return num_threads; }
+
+		//calls job(index, worker) for every index in [0, num_jobs) and
+		//returns when all of them have finished
+		void run(int num_jobs, const std::function<void(int job, int worker)>& job);
+
+		//number of hardware threads, at least 1
+		static int hardwareThreads();
+
+	private:
+		class Worker {
+			public:
+				std::mutex lock;
+				std::deque<int> jobs;
+		};
+
+		int num_threads;
+		std::vector<std::unique_ptr<Worker>> workers;
+
+		bool pop(int worker, int& job);
+		bool steal(int thief, int& job);
+};
+
+#endif
@@ -0,0 +1,237 @@
+#include "triblock.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TRIBLOCK_X86
+#endif
+
+TriBlock::TriBlock()
+{
+    for (int i = 0; i < width; i++)
+    {
+        vx[i] = vy[i] = vz[i] = 0.0f;
+        e1x[i] = e1y[i] = e1z[i] = 0.0f;
+        e2x[i] = e2y[i] = e2z[i] = 0.0f;
+        index[i] = -1;
+    }
+}
+
+void TriBlock::set(int lane, const Triangle &tri, int primitive)
+{
+    vx[lane] = tri.vertex.x;
+    vy[lane] = tri.vertex.y;
+    vz[lane] = tri.vertex.z;
+    e1x[lane] = tri.edge1.x;
+    e1y[lane] = tri.edge1.y;
+    e1z[lane] = tri.edge1.z;
+    e2x[lane] = tri.edge2.x;
+    e2y[lane] = tri.edge2.y;
+    e2z[lane] = tri.edge2.z;
+    index[lane] = primitive;
+}
+
+// Moller-Trumbore on one lane, the same operations as Triangle::hit
+static inline bool laneHit(const TriBlock &b, int i, const Ray &ray, float t_min, float &t_val, glm::vec2 &bary)
+{
+    glm::vec3 vertex(b.vx[i], b.vy[i], b.vz[i]);
+    glm::vec3 edge1(b.e1x[i], b.e1y[i], b.e1z[i]);
+    glm::vec3 edge2(b.e2x[i], b.e2y[i], b.e2z[i]);
+
+    glm::vec3 pvec = glm::cross(ray.direction, edge2);
+    float det = glm::dot(edge1, pvec);
+    if (glm::abs(det) < epsilon)
+        return false;
+
+    float inv_det = 1.0f / det;
+    glm::vec3 tvec = ray.origin - vertex;
+
+    float beta = glm::dot(tvec, pvec) * inv_det;
+    if (beta < -epsilon || beta > 1.0f + epsilon)
+        return false;
+
+    glm::vec3 qvec = glm::cross(tvec, edge1);
+    float gamma = glm::dot(ray.direction, qvec) * inv_det;
+    float alpha = 1.0f - beta - gamma;
+    if (gamma < -epsilon || gamma > 1.0f + epsilon ||
+        alpha < -epsilon || alpha > 1.0f + epsilon)
+        return false;
+
+    t_val = glm::dot(edge2, qvec) * inv_det;
+    if (t_val <= t_min)
+        return false;
+
+    bary = glm::vec2(beta, gamma);
+    return true;
+}
+
+// nearer than the current hit, ties go to the lower primitive number
+static inline bool closer(float t, int index, float t_val, int closest_index)
+{
+    return t < t_val || (t == t_val && index < closest_index);
+}
+
+static bool hitScalar(const TriBlock &block, const Ray &ray, float t_min, float &t_val, int &index, glm::vec2 &bary)
+{
+    bool found = false;
+    for (int i = 0; i < TriBlock::width; i++)
+    {
+        float t;
+        glm::vec2 uv;
+        if (block.index[i] >= 0 && laneHit(block, i, ray, t_min, t, uv) && closer(t, block.index[i], t_val, index))
+        {
+            t_val = t;
+            index = block.index[i];
+            bary = uv;
+            found = true;
+        }
+    }
+    return found;
+}
+
+static bool occludesScalar(const TriBlock &block, const Ray &ray, float t_min, float t_max)
+{
+    for (int i = 0; i < TriBlock::width; i++)
+    {
+        float t;
+        glm::vec2 uv;
+        if (block.index[i] >= 0 && laneHit(block, i, ray, t_min, t, uv) && t < t_max)
+            return true;
+    }
+    return false;
+}
+
+#ifdef TRIBLOCK_X86
+
+// the 8 lanes of laneHit. products and sums are done in the same order as
+// the glm cross and dot products, so the results match bit for bit.
+// the NLT/NGT/NLE compares are the negations of the rejections in laneHit
+__attribute__((target("avx2"))) static inline int laneMaskAVX2(const TriBlock &b, const Ray &ray, float t_min,
+                                                             __m256 &t, __m256 &beta, __m256 &gamma)
+{
+    const __m256 ox = _mm256_set1_ps(ray.origin.x);
+    const __m256 oy = _mm256_set1_ps(ray.origin.y);
+    const __m256 oz = _mm256_set1_ps(ray.origin.z);
+    const __m256 dx = _mm256_set1_ps(ray.direction.x);
+    const __m256 dy = _mm256_set1_ps(ray.direction.y);
+    const __m256 dz = _mm256_set1_ps(ray.direction.z);
+    const __m256 e1x = _mm256_load_ps(b.e1x);
+    const __m256 e1y = _mm256_load_ps(b.e1y);
+    const __m256 e1z = _mm256_load_ps(b.e1z);
+    const __m256 e2x = _mm256_load_ps(b.e2x);
+    const __m256 e2y = _mm256_load_ps(b.e2y);
+    const __m256 e2z = _mm256_load_ps(b.e2z);
+
+    const __m256 eps = _mm256_set1_ps(epsilon);
+    const __m256 neg_eps = _mm256_set1_ps(-epsilon);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 one_eps = _mm256_set1_ps(1.0f + epsilon);
+
+    // pvec = cross(direction, edge2)
+    __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(e2y, dz));
+    __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(e2z, dx));
+    __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(e2x, dy));
+
+    __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+    __m256 abs_det = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), det);
+    __m256 valid = _mm256_cmp_ps(abs_det, eps, _CMP_NLT_UQ);
+    if (_mm256_movemask_ps(valid) == 0)
+        return 0;
+
+    __m256 inv_det = _mm256_div_ps(one, det);
+    __m256 tx = _mm256_sub_ps(ox, _mm256_load_ps(b.vx));
+    __m256 ty = _mm256_sub_ps(oy, _mm256_load_ps(b.vy));
+    __m256 tz = _mm256_sub_ps(oz, _mm256_load_ps(b.vz));
+
+    beta = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), inv_det);
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(beta, neg_eps, _CMP_NLT_UQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(beta, one_eps, _CMP_NGT_UQ));
+    if (_mm256_movemask_ps(valid) == 0)
+        return 0;
+
+    // qvec = cross(tvec, edge1)
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(e1y, tz));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(e1z, tx));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(e1x, ty));
+
+    gamma = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv_det);
+    __m256 alpha = _mm256_sub_ps(_mm256_sub_ps(one, beta), gamma);
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(gamma, neg_eps, _CMP_NLT_UQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(gamma, one_eps, _CMP_NGT_UQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(alpha, neg_eps, _CMP_NLT_UQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(alpha, one_eps, _CMP_NGT_UQ));
+
+    t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv_det);
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, _mm256_set1_ps(t_min), _CMP_NLE_UQ));
+
+    return _mm256_movemask_ps(valid);
+}
+
+__attribute__((target("avx2"))) static bool hitAVX2(const TriBlock &block, const Ray &ray, float t_min, float &t_val, int &index, glm::vec2 &bary)
+{
+    __m256 t, beta, gamma;
+    int mask = laneMaskAVX2(block, ray, t_min, t, beta, gamma);
+    if (mask == 0)
+        return false;
+
+    alignas(32) float ts[TriBlock::width], betas[TriBlock::width], gammas[TriBlock::width];
+    _mm256_store_ps(ts, t);
+    _mm256_store_ps(betas, beta);
+    _mm256_store_ps(gammas, gamma);
+
+    bool found = false;
+    for (int i = 0; i < TriBlock::width; i++)
+    {
+        if ((mask & (1 << i)) && closer(ts[i], block.index[i], t_val, index))
+        {
+            t_val = ts[i];
+            index = block.index[i];
+            bary = glm::vec2(betas[i], gammas[i]);
+            found = true;
+        }
+    }
+    return found;
+}
+
+__attribute__((target("avx2"))) static bool occludesAVX2(const TriBlock &block, const Ray &ray, float t_min, float t_max)
+{
+    __m256 t, beta, gamma;
+    int mask = laneMaskAVX2(block, ray, t_min, t, beta, gamma);
+    if (mask == 0)
+        return false;
+    return (mask & _mm256_movemask_ps(_mm256_cmp_ps(t, _mm256_set1_ps(t_max), _CMP_LT_OQ))) != 0;
+}
+
+static bool haveAVX2()
+{
+    __builtin_cpu_init(); // needed before static constructors may ask
+    return __builtin_cpu_supports("avx2");
+}
+
+TriBlock::HitKernel TriBlock::hit_kernel = haveAVX2() ? hitAVX2 : hitScalar;
+TriBlock::OccludesKernel TriBlock::occludes_kernel = haveAVX2() ? occludesAVX2 : occludesScalar;
+
+#else
+
+static bool haveAVX2() { return false; }
+
+TriBlock::HitKernel TriBlock::hit_kernel = hitScalar;
+TriBlock::OccludesKernel TriBlock::occludes_kernel = occludesScalar;
+
+#endif
+
+bool TriBlock::useAVX2(bool enable)
+{
+    if (enable && !haveAVX2())
+        return false;
+
+#ifdef TRIBLOCK_X86
+    hit_kernel = enable ? hitAVX2 : hitScalar;
+    occludes_kernel = enable ? occludesAVX2 : occludesScalar;
+#endif
+    return true;
+}
+
+const char *TriBlock::kernelName()
+{
+    return hit_kernel == hitScalar ? "scalar" : "avx2";
+}
@@ -0,0 +1,49 @@
+#ifndef TRIBLOCK_H
+#define TRIBLOCK_H
+
+#include "geometry.h"
+
+//eight triangles in structure of arrays layout, tested against one ray at
+//a time by an 8-wide kernel. the kernel is picked once at startup: AVX2 if
+//the CPU has it, a scalar loop over the lanes otherwise. both compute
+//exactly what Triangle::hit computes for every lane.
+//unused lanes have zero edges and index -1, they are never hit
+class alignas(32) TriBlock {
+	public:
+		static const int width = 8;
+
+		float vx[width], vy[width], vz[width]; //vertex A
+		float e1x[width], e1y[width], e1z[width]; //edge B-A
+		float e2x[width], e2y[width], e2z[width]; //edge C-A
+		int index[width]; //BVH primitive number of each lane
+
+		TriBlock();
+
+		void set(int lane, const Triangle& tri, int primitive);
+
+		//closest lane hit with t > t_min that is nearer than t_val (on a tie,
+		//with a smaller primitive number than index). updates t_val, index and
+		//bary and returns true if such a lane exists
+		bool hit(const Ray& ray, float t_min, float& t_val, int& index, glm::vec2& bary) const {
+			return hit_kernel(*this, ray, t_min, t_val, index, bary);
+		}
+
+		//true if some lane is hit with t_min < t < t_max
+		bool occludes(const Ray& ray, float t_min, float t_max) const {
+			return occludes_kernel(*this, ray, t_min, t_max);
+		}
+
+		//switch between the AVX2 and the scalar kernels, e.g. to compare
+		//them. returns false if AVX2 was asked for but is not supported
+		static bool useAVX2(bool enable);
+		static const char* kernelName();
+
+	private:
+		typedef bool (*HitKernel)(const TriBlock&, const Ray&, float, float&, int&, glm::vec2&);
+		typedef bool (*OccludesKernel)(const TriBlock&, const Ray&, float, float);
+
+		static HitKernel hit_kernel;
+		static OccludesKernel occludes_kernel;
+};
+
+#endif
@@ -0,0 +1,215 @@
+#include <cmath>
+
+#include "widenode.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WIDENODE_X86
+#endif
+
+NodeRay::NodeRay(const Ray &ray)
+{
+    origin = ray.origin;
+    inv_dir = 1.0f / ray.direction;
+    for (int axis = 0; axis < 3; axis++)
+        negative[axis] = std::signbit(ray.direction[axis]);
+}
+
+WideNode::WideNode()
+{
+    for (int i = 0; i < width; i++)
+    {
+        lo_x[i] = lo_y[i] = lo_z[i] = std::numeric_limits<float>::max();
+        hi_x[i] = hi_y[i] = hi_z[i] = -std::numeric_limits<float>::max();
+        child[i] = 0;
+    }
+}
+
+void WideNode::set(int lane, const AABB &box, int child_index)
+{
+    lo_x[lane] = box.lo.x;
+    lo_y[lane] = box.lo.y;
+    lo_z[lane] = box.lo.z;
+    hi_x[lane] = box.hi.x;
+    hi_y[lane] = box.hi.y;
+    hi_z[lane] = box.hi.z;
+    child[lane] = child_index;
+}
+
+AABB WideNode::bounds(int lane) const
+{
+    AABB box;
+    box.lo = glm::vec3(lo_x[lane], lo_y[lane], lo_z[lane]);
+    box.hi = glm::vec3(hi_x[lane], hi_y[lane], hi_z[lane]);
+    return box;
+}
+
+QuantizedNode::QuantizedNode() : origin(0.0f), scale(1.0f)
+{
+    for (int i = 0; i < width; i++)
+    {
+        lo_x[i] = lo_y[i] = lo_z[i] = 255;
+        hi_x[i] = hi_y[i] = hi_z[i] = 0;
+        child[i] = 0;
+    }
+}
+
+void QuantizedNode::setBounds(const AABB &box)
+{
+    origin = box.lo;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float extent = box.hi[axis] - box.lo[axis];
+        scale[axis] = extent > 0.0f ? std::exp2(std::ceil(std::log2(extent / 255.0f))) : 1.0f;
+        // 255 steps must reach hi after rounding the sum
+        while (origin[axis] + 255.0f * scale[axis] < box.hi[axis])
+            scale[axis] *= 2.0f;
+    }
+}
+
+void QuantizedNode::set(int lane, const AABB &box, int child_index)
+{
+    uint8_t *lo[3] = {lo_x, lo_y, lo_z};
+    uint8_t *hi[3] = {hi_x, hi_y, hi_z};
+    for (int axis = 0; axis < 3; axis++)
+    {
+        // round outwards, then make sure the decoded values still enclose the box
+        float o = origin[axis], s = scale[axis];
+        int q_lo = (int)std::max(std::floor((box.lo[axis] - o) / s), 0.0f);
+        int q_hi = (int)std::min(std::ceil((box.hi[axis] - o) / s), 255.0f);
+        while (q_lo > 0 && o + (float)q_lo * s > box.lo[axis])
+            q_lo--;
+        while (q_hi < 255 && o + (float)q_hi * s < box.hi[axis])
+            q_hi++;
+        lo[axis][lane] = q_lo;
+        hi[axis][lane] = q_hi;
+    }
+    child[lane] = child_index;
+}
+
+AABB QuantizedNode::bounds(int lane) const
+{
+    AABB box;
+    box.lo = origin + glm::vec3(lo_x[lane], lo_y[lane], lo_z[lane]) * scale;
+    box.hi = origin + glm::vec3(hi_x[lane], hi_y[lane], hi_z[lane]) * scale;
+    return box;
+}
+
+// minimum and maximum as the SSE/AVX instructions compute them, returning
+// b if either is NaN, so that the scalar and SIMD kernels agree
+static inline float minLane(float a, float b)
+{
+    return a < b ? a : b;
+}
+
+static inline float maxLane(float a, float b)
+{
+    return a > b ? a : b;
+}
+
+// the slab test of one lane, from the planes the ray meets first (near)
+// and last (far) along each axis
+static inline bool laneHit(const NodeRay &ray, const glm::vec3 &near, const glm::vec3 &far,
+                           float t_min, float t_max, float &dist)
+{
+    float t_near = maxLane(maxLane((near.x - ray.origin.x) * ray.inv_dir.x, (near.y - ray.origin.y) * ray.inv_dir.y),
+                           (near.z - ray.origin.z) * ray.inv_dir.z);
+    float t_far = minLane(minLane((far.x - ray.origin.x) * ray.inv_dir.x, (far.y - ray.origin.y) * ray.inv_dir.y),
+                          (far.z - ray.origin.z) * ray.inv_dir.z);
+    dist = maxLane(t_near, 0.0f);
+    return t_near <= t_far && t_far >= t_min && dist <= t_max;
+}
+
+// either node type, a lane at a time from the decoded bounds
+template <class Node>
+static int hitScalar(const Node &node, const NodeRay &ray, float t_min, float t_max, float *dist)
+{
+    int mask = 0;
+    for (int i = 0; i < Node::width; i++)
+    {
+        AABB box = node.bounds(i);
+        glm::vec3 near(ray.negative[0] ? box.hi.x : box.lo.x, ray.negative[1] ? box.hi.y : box.lo.y,
+                       ray.negative[2] ? box.hi.z : box.lo.z);
+        glm::vec3 far(ray.negative[0] ? box.lo.x : box.hi.x, ray.negative[1] ? box.lo.y : box.hi.y,
+                      ray.negative[2] ? box.lo.z : box.hi.z);
+        if (laneHit(ray, near, far, t_min, t_max, dist[i]))
+            mask |= 1 << i;
+    }
+    return mask;
+}
+
+#ifdef WIDENODE_X86
+
+// the 8 lanes of laneHit, given the near and far planes of every lane
+__attribute__((target("avx2"))) static inline int slabsAVX2(const NodeRay &ray, const __m256 *near, const __m256 *far,
+                                                            float t_min, float t_max, float *dist)
+{
+    const __m256 ox = _mm256_set1_ps(ray.origin.x);
+    const __m256 oy = _mm256_set1_ps(ray.origin.y);
+    const __m256 oz = _mm256_set1_ps(ray.origin.z);
+    const __m256 ix = _mm256_set1_ps(ray.inv_dir.x);
+    const __m256 iy = _mm256_set1_ps(ray.inv_dir.y);
+    const __m256 iz = _mm256_set1_ps(ray.inv_dir.z);
+
+    __m256 t_near = _mm256_max_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(near[0], ox), ix),
+                                                _mm256_mul_ps(_mm256_sub_ps(near[1], oy), iy)),
+                                  _mm256_mul_ps(_mm256_sub_ps(near[2], oz), iz));
+    __m256 t_far = _mm256_min_ps(_mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(far[0], ox), ix),
+                                               _mm256_mul_ps(_mm256_sub_ps(far[1], oy), iy)),
+                                 _mm256_mul_ps(_mm256_sub_ps(far[2], oz), iz));
+    __m256 d = _mm256_max_ps(t_near, _mm256_setzero_ps());
+
+    __m256 valid = _mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ);
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(t_far, _mm256_set1_ps(t_min), _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(d, _mm256_set1_ps(t_max), _CMP_LE_OQ));
+
+    _mm256_storeu_ps(dist, d);
+    return _mm256_movemask_ps(valid);
+}
+
+__attribute__((target("avx2"))) static int hitAVX2(const WideNode &node, const NodeRay &ray, float t_min, float t_max, float *dist)
+{
+    __m256 near[3], far[3];
+    near[0] = _mm256_load_ps(ray.negative[0] ? node.hi_x : node.lo_x);
+    near[1] = _mm256_load_ps(ray.negative[1] ? node.hi_y : node.lo_y);
+    near[2] = _mm256_load_ps(ray.negative[2] ? node.hi_z : node.lo_z);
+    far[0] = _mm256_load_ps(ray.negative[0] ? node.lo_x : node.hi_x);
+    far[1] = _mm256_load_ps(ray.negative[1] ? node.lo_y : node.hi_y);
+    far[2] = _mm256_load_ps(ray.negative[2] ? node.lo_z : node.hi_z);
+    return slabsAVX2(ray, near, far, t_min, t_max, dist);
+}
+
+// origin + q * scale for 8 quantized values
+__attribute__((target("avx2"))) static inline __m256 decodeAVX2(const uint8_t *q, float origin, float scale)
+{
+    __m256 values = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)q)));
+    return _mm256_add_ps(_mm256_set1_ps(origin), _mm256_mul_ps(values, _mm256_set1_ps(scale)));
+}
+
+__attribute__((target("avx2"))) static int hitQuantizedAVX2(const QuantizedNode &node, const NodeRay &ray, float t_min, float t_max, float *dist)
+{
+    __m256 near[3], far[3];
+    near[0] = decodeAVX2(ray.negative[0] ? node.hi_x : node.lo_x, node.origin.x, node.scale.x);
+    near[1] = decodeAVX2(ray.negative[1] ? node.hi_y : node.lo_y, node.origin.y, node.scale.y);
+    near[2] = decodeAVX2(ray.negative[2] ? node.hi_z : node.lo_z, node.origin.z, node.scale.z);
+    far[0] = decodeAVX2(ray.negative[0] ? node.lo_x : node.hi_x, node.origin.x, node.scale.x);
+    far[1] = decodeAVX2(ray.negative[1] ? node.lo_y : node.hi_y, node.origin.y, node.scale.y);
+    far[2] = decodeAVX2(ray.negative[2] ? node.lo_z : node.hi_z, node.origin.z, node.scale.z);
+    return slabsAVX2(ray, near, far, t_min, t_max, dist);
+}
+
+static bool haveAVX2()
+{
+    __builtin_cpu_init(); // needed before static constructors may ask
+    return __builtin_cpu_supports("avx2");
+}
+
+WideNode::HitKernel WideNode::hit_kernel = haveAVX2() ? hitAVX2 : hitScalar<WideNode>;
+QuantizedNode::HitKernel QuantizedNode::hit_kernel = haveAVX2() ? hitQuantizedAVX2 : hitScalar<QuantizedNode>;
+
+#else
+
+WideNode::HitKernel WideNode::hit_kernel = hitScalar<WideNode>;
+QuantizedNode::HitKernel QuantizedNode::hit_kernel = hitScalar<QuantizedNode>;
+
+#endif
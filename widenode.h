@@ -0,0 +1,83 @@
+#ifndef WIDENODE_H
+#define WIDENODE_H
+
+#include <cstdint>
+
+#include "geometry.h"
+
+//a ray prepared for the child bounds tests of wide nodes. the sign of the
+//direction tells which of the two planes of an axis the ray meets first,
+//so the kernels pick the near and far planes without comparing them
+class NodeRay {
+	public:
+		glm::vec3 origin;
+		glm::vec3 inv_dir;
+		bool negative[3]; //direction below zero (or -0) along the axis: the near plane is hi
+
+		NodeRay() {}
+		NodeRay(const Ray& ray);
+};
+
+//node of the wide BVH that rays traverse, with up to 8 children. their
+//bounds are in structure of arrays layout, so one 8-wide kernel call tests
+//a ray against all of them. like TriBlock, the kernel is AVX2 if the CPU
+//has it and a scalar loop otherwise, and both compute the same.
+//child[i] > 0 is an inner node, child[i] < 0 the leaf ~child[i] of
+//BVH::leaves, and 0 an unused lane. unused lanes have empty bounds
+//(lo > hi), which no ray enters
+class alignas(32) WideNode {
+	public:
+		static const int width = 8;
+
+		float lo_x[width], lo_y[width], lo_z[width];
+		float hi_x[width], hi_y[width], hi_z[width];
+		int child[width];
+
+		WideNode();
+
+		//the bounds of the node itself. only quantized nodes need them
+		void setBounds(const AABB&) {}
+		void set(int lane, const AABB& box, int child);
+		AABB bounds(int lane) const;
+
+		//mask of the children the ray enters with t_near <= t_max and
+		//t_far >= t_min. dist[i] is max(t_near, 0) for the lanes in the mask
+		int hit(const NodeRay& ray, float t_min, float t_max, float* dist) const {
+			return hit_kernel(*this, ray, t_min, t_max, dist);
+		}
+
+	private:
+		typedef int (*HitKernel)(const WideNode&, const NodeRay&, float, float, float*);
+		static HitKernel hit_kernel;
+};
+
+//WideNode with the child bounds quantized to 8 bits within the bounds of
+//the node, rounded outwards. less than half the size, for slightly larger
+//boxes. the step is a power of two, so decoding is exact up to the add
+class alignas(8) QuantizedNode {
+	public:
+		static const int width = 8;
+
+		glm::vec3 origin; //lo of the node
+		glm::vec3 scale; //size of one step per axis
+		uint8_t lo_x[width], lo_y[width], lo_z[width];
+		uint8_t hi_x[width], hi_y[width], hi_z[width];
+		int child[width];
+
+		QuantizedNode();
+
+		//must come before the lanes are set
+		void setBounds(const AABB& box);
+		void set(int lane, const AABB& box, int child);
+		AABB bounds(int lane) const;
+
+		int hit(const NodeRay& ray, float t_min, float t_max, float* dist) const {
+			return hit_kernel(*this, ray, t_min, t_max, dist);
+		}
+
+	private:
+		typedef int (*HitKernel)(const QuantizedNode&, const NodeRay&, float, float, float*);
+		static HitKernel hit_kernel;
+};
+
+#endif